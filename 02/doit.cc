@@ -4,19 +4,18 @@
 // ./doit 2 < input  # part 2
 
 #include <iostream>
+#include <string>
 #include <vector>
 #include <cassert>
 
+#include "../intcode/parse.h"
+
 using namespace std;
 
 vector<int> read() {
+  string text = slurp(cin);
   vector<int> code;
-  int n;
-  while (cin >> n) {
-    code.push_back(n);
-    if (cin.peek() == ',')
-      cin.ignore(1);
-  }
+  parse_csv(text.data(), text.data() + text.size(), code);
   return code;
 }
 
@@ -1,206 +1,57 @@
 // -*- C++ -*-
-// g++ -std=c++17 -Wall -g -o doit doit.cc
+// g++ -std=c++17 -Wall -g -pthread -o doit doit.cc
 // ./doit 1 < input  # part 1
 // ./doit 2 < input  # part 2
+// ./doit 2 0123456789 < input  # ten amplifiers, 3.6M orderings
 
 #include <iostream>
-#include <sstream>
 #include <vector>
-#include <list>
 #include <algorithm>
+#include <mutex>
 #include <cassert>
 
-using namespace std;
-
-struct CPU {
-  // Storage
-  vector<int> memory;
-  // Instruction pointer
-  unsigned ip{0};
-  // Was a halt instruction was executed?
-  bool halted{false};
+#include "../intcode/intcode.h"
 
-  // Things read by input instructions
-  list<int> input_values;
-  // Things written by output instructions
-  list<int> output_values;
-
-  // Return memory location contents
-  int mem(unsigned addr) const {
-    assert(addr < memory.size());
-    return memory[addr];
-  }
-
-  // Fetch the next instruction (or the next part of the current
-  // instruction)
-  int fetch() { return mem(ip++); }
-  // Read the next argument in an instruction, handle it appropriately
-  // depending on the argument mode (position or immediate), update
-  // mode in preparation for next argument
-  int arg(int &mode);
-  // Read the address where an operation should store a result, update
-  // memory
-  void store(int v);
+using namespace std;
 
-  // Supply a value for input instructions
-  void give_input(int v) { input_values.push_back(v); }
-  // Retrieve the next input value (which must exist)
-  int get_input();
-  // Save an output value
-  void save_output(int v) { output_values.push_back(v); }
-  // Return whatever the last output value was
-  int last_output() const;
-  // Send available output values to another CPU (clears all output)
-  void transmit(CPU &other);
+// A chain of amplifiers, reused for each ordering of phases
+struct amplifiers {
+  // One CPU per stage
+  vector<CPU> stages;
+  // Snapshot of each stage right after loading
+  vector<size_t> fresh;
 
-  // Execute the next instruction, return true if OK, false if
-  // something stops execution (halt instruction or input with no
-  // available data)
-  bool execute();
-  // Execute instructions until the CPU halts or pauses waiting for
-  // data at an input instruction.  Return true if the CPU halted.
-  bool run();
+  amplifiers(CPU const &cpu, size_t n);
 
-  // Construct from stdin
-  CPU();
+  // Run stages, feeding output from each stage into the next, until
+  // the last stage halts (or no stage can make progress), then give
+  // the last output from the last stage
+  num amplify(vector<int> const &phases);
 };
 
-CPU::CPU() {
-  string line;
-  while (getline(cin, line)) {
-    if (line.empty())
-      continue;
-    bool more_lines = line.back() == ',';
-    if (!more_lines)
-      line.push_back(',');
-    stringstream ss(line);
-    int n;
-    char comma;
-    while (ss >> n >> comma)
-      memory.push_back(n);
-    if (!more_lines)
-      break;
-  }
-}
-
-enum opcode { add = 1, mul, input, output,
-              jtrue, jfalse, lt, eq,
-              halt = 99 };
-
-int CPU::arg(int &mode) {
-  int v = fetch();
-  if (mode % 10 == 0)
-    v = mem(v);
-  mode /= 10;
-  return v;
-}
-
-void CPU::store(int v) {
-  unsigned addr = fetch();
-  assert(addr < memory.size());
-  memory[addr] = v;
+amplifiers::amplifiers(CPU const &cpu, size_t n) : stages(n, cpu) {
+  for (auto &stage : stages)
+    fresh.push_back(stage.snapshot());
 }
 
-int CPU::get_input() {
-  assert(!input_values.empty());
-  int v = input_values.front();
-  input_values.pop_front();
-  return v;
-}
-
-int CPU::last_output() const {
-  assert(!output_values.empty());
-  return output_values.back();
-}
-
-void CPU::transmit(CPU &other) {
-  auto &q = other.input_values;
-  q.splice(q.end(), output_values);
-}
-
-bool CPU::execute() {
-  int op_and_modes = fetch();
-  auto op = opcode(op_and_modes % 100);
-  int mode = op_and_modes / 100;
-  switch (op) {
-  case add:
-    { int arg1 = arg(mode);
-      int arg2 = arg(mode);
-      store(arg1 + arg2);
-      break;
-    }
-  case mul:
-    { int arg1 = arg(mode);
-      int arg2 = arg(mode);
-      store(arg1 * arg2);
-      break;
-    }
-  case input:
-    { if (input_values.empty()) {
-        // Pause execution for later resumption at this same
-        // instruction
-        --ip;
-        return false;
-      }
-      store(get_input());
-      break;
-    }
-  case output:
-    { save_output(arg(mode));
-      break;
-    }
-  case jtrue:
-    { int test = arg(mode);
-      int dest = arg(mode);
-      if (test)
-        ip = dest;
-      break;
-    }
-  case jfalse:
-    { int test = arg(mode);
-      int dest = arg(mode);
-      if (!test)
-        ip = dest;
-      break;
-    }
-  case lt:
-    { int arg1 = arg(mode);
-      int arg2 = arg(mode);
-      store(arg1 < arg2);
-      break;
-    }
-  case eq:
-    { int arg1 = arg(mode);
-      int arg2 = arg(mode);
-      store(arg1 == arg2);
-      break;
-    }
-  case halt:
-    halted = true;
-    return false;
-  }
-  return true;
-}
-
-bool CPU::run() {
-  while (execute())
-    ;
-  return halted;
-}
-
-// Run stages, feeding output from each stage into the next, until the
-// last stage halts, then give output from the last stage
-int amplify(CPU const &cpu, vector<int> const &phases) {
-  vector<CPU> stages;
-  for (auto phase : phases) {
-    stages.push_back(cpu);
-    stages.back().give_input(phase);
+num amplifiers::amplify(vector<int> const &phases) {
+  assert(phases.size() == stages.size());
+  for (size_t i = 0; i < stages.size(); ++i) {
+    stages[i].restore(fresh[i]);
+    stages[i].give_input(phases[i]);
   }
   stages.front().give_input(0);
+  num result = 0;
   bool last_halted = false;
-  while (!last_halted)
+  while (!last_halted) {
+    bool progress = false;
     for (size_t i = 0; i < stages.size(); ++i) {
       bool done = stages[i].run();
+      if (stages[i].has_output()) {
+        progress = true;
+        if (i + 1 == stages.size())
+          result = stages[i].last_output();
+      }
       if (i + 1 < stages.size())
         stages[i].transmit(stages[i + 1]);
       else if (!done)
@@ -208,29 +59,90 @@ int amplify(CPU const &cpu, vector<int> const &phases) {
       else
         last_halted = true;
     }
-  return stages.back().last_output();
+    if (!progress)
+      // Everybody's stuck waiting for input
+      break;
+  }
+  return result;
+}
+
+// Set phases to the k-th permutation (in lexicographic order) of the
+// sorted values in phases
+void unrank(vector<int> &phases, size_t k) {
+  sort(phases.begin(), phases.end());
+  vector<int> pool(phases);
+  size_t fact = 1;
+  for (size_t i = 2; i < pool.size(); ++i)
+    fact *= i;
+  for (size_t i = 0; i < phases.size(); ++i) {
+    size_t j = k / fact;
+    k %= fact;
+    phases[i] = pool[j];
+    pool.erase(pool.begin() + j);
+    if (i + 1 < phases.size())
+      fact /= phases.size() - 1 - i;
+  }
 }
 
+// Try all orderings of phases, searching in parallel.  Each thread has
+// its own set of amplifiers.
 void solve(vector<int> phases) {
+  sort(phases.begin(), phases.end());
+  assert(adjacent_find(phases.begin(), phases.end()) == phases.end());
   CPU cpu;
-  int max_output = 0;
-  do
-    max_output = max(max_output, amplify(cpu, phases));
-  while (next_permutation(phases.begin(), phases.end()));
-  cout << max_output << '\n';
+  size_t orderings = 1;
+  for (size_t i = 2; i <= phases.size(); ++i)
+    orderings *= i;
+  num best = 0;
+  mutex best_lock;
+  auto search =
+    [&](auto take) {
+      amplifiers amps(cpu, phases.size());
+      vector<int> order(phases);
+      num mine = 0;
+      size_t first, last;
+      while (take(first, last)) {
+        unrank(order, first);
+        for (size_t k = first; k < last; ++k) {
+          mine = max(mine, amps.amplify(order));
+          next_permutation(order.begin(), order.end());
+        }
+      }
+      lock_guard<mutex> hold(best_lock);
+      best = max(best, mine);
+    };
+  parallel_chunks(orderings, 256, search);
+  cout << best << '\n';
+}
+
+// Phases can be given as a string of digits, e.g., 0123456789 for a
+// ten-amplifier chain
+vector<int> phases_from(char const *digits, vector<int> const &dflt) {
+  if (!digits)
+    return dflt;
+  vector<int> result;
+  for (char const *p = digits; *p; ++p)
+    result.push_back(*p - '0');
+  return result;
 }
 
-void part1() { solve({ 0, 1, 2, 3, 4 }); }
-void part2() { solve({ 5, 6, 7, 8, 9 }); }
+void part1(char const *digits) {
+  solve(phases_from(digits, { 0, 1, 2, 3, 4 }));
+}
+
+void part2(char const *digits) {
+  solve(phases_from(digits, { 5, 6, 7, 8, 9 }));
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    cerr << "usage: " << argv[0] << " partnum < input\n";
+  if (argc != 2 && argc != 3) {
+    cerr << "usage: " << argv[0] << " partnum [phases] < input\n";
     exit(1);
   }
+  char const *digits = argc == 3 ? argv[2] : nullptr;
   if (*argv[1] == '1')
-    part1();
+    part1(digits);
   else
-    part2();
+    part2(digits);
   return 0;
 }
@@ -1,222 +1,20 @@
 // -*- C++ -*-
-// g++ -std=c++17 -Wall -g -o doit doit.cc
+// g++ -std=c++17 -Wall -g -pthread -o doit doit.cc
 // ./doit 1 < input  # part 1
 // ./doit 2 < input  # part 2
 
 #include <iostream>
-#include <sstream>
 #include <vector>
+#include <array>
 #include <list>
-#include <map>
 #include <set>
 #include <optional>
+#include <algorithm>
 #include <cassert>
 
-using namespace std;
-
-using num = long;
-
-struct CPU {
-  // Storage
-  vector<num> memory;
-  // Instruction pointer
-  num ip{0};
-  // Relative base
-  num rel_base{0};
-  // Was a halt instruction was executed?
-  bool halted{false};
-
-  // Things read by input instructions
-  list<num> input_values;
-  // Things written by output instructions
-  list<num> output_values;
-
-  // Return memory location
-  num &mem(num addr) {
-    assert(addr >= 0);
-    if (size_t(addr) >= memory.size())
-      memory.resize(max(size_t(addr) + 100, 2 * memory.size()), 0);
-    return memory[addr];
-  }
-
-  // Fetch the next instruction (or the next part of the current
-  // instruction)
-  num fetch() { return mem(ip++); }
-  // Read the next argument in an instruction, handle it appropriately
-  // depending on the argument mode (position or immediate or
-  // relative), update mode in preparation for next argument
-  num arg(num &mode);
-  // Read the address where an operation should store a result, update
-  // memory.  Mode must be position or relative.
-  void store(num mode, num v);
-
-  // Supply a value for input instructions
-  void give_input(num v) { input_values.push_back(v); }
-  // Retrieve the next input value (which must exist)
-  num get_input();
-  // Save an output value
-  void save_output(num v) { output_values.push_back(v); }
-  // Return whatever the last output value was
-  num last_output() const;
-  // Get output and remove
-  num get_output();
-  // Send available output values to another CPU (clears all output)
-  void transmit(CPU &other);
-
-  // Execute the next instruction, return true if OK, false if
-  // something stops execution (halt instruction or input with no
-  // available data)
-  bool execute();
-  // Execute instructions until the CPU halts or pauses waiting for
-  // data at an input instruction.  Return true if the CPU halted.
-  bool run();
-
-  // Construct from stdin
-  CPU();
-};
-
-CPU::CPU() {
-  string line;
-  while (getline(cin, line)) {
-    if (line.empty())
-      continue;
-    bool more_lines = line.back() == ',';
-    if (!more_lines)
-      line.push_back(',');
-    stringstream ss(line);
-    num n;
-    char comma;
-    while (ss >> n >> comma)
-      memory.push_back(n);
-    if (!more_lines)
-      break;
-  }
-}
-
-enum opcode { add = 1, mul, input, output,
-              jtrue, jfalse, lt, eq, relbase,
-              halt = 99 };
-
-num CPU::arg(num &mode) {
-  num v = fetch();
-  int m = mode % 10;
-  if (m == 0)
-    v = mem(v);
-  else if (m == 2)
-    v = mem(v + rel_base);
-  mode /= 10;
-  return v;
-}
-
-void CPU::store(num mode, num v) {
-  assert(mode == 0 || mode == 2);
-  num addr = fetch();
-  if (mode == 2)
-    addr += rel_base;
-  mem(addr) = v;
-}
-
-num CPU::get_input() {
-  assert(!input_values.empty());
-  num v = input_values.front();
-  input_values.pop_front();
-  return v;
-}
-
-num CPU::last_output() const {
-  assert(!output_values.empty());
-  return output_values.back();
-}
-
-num CPU::get_output() {
-  assert(!output_values.empty());
-  num out = output_values.front();
-  output_values.pop_front();
-  return out;
-}
-
-void CPU::transmit(CPU &other) {
-  auto &q = other.input_values;
-  q.splice(q.end(), output_values);
-}
-
-bool CPU::execute() {
-  num op_and_modes = fetch();
-  auto op = opcode(op_and_modes % 100);
-  num mode = op_and_modes / 100;
-  switch (op) {
-  case add:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 + arg2);
-      break;
-    }
-  case mul:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 * arg2);
-      break;
-    }
-  case input:
-    { if (input_values.empty()) {
-        // Pause execution for later resumption at this same
-        // instruction
-        --ip;
-        return false;
-      }
-      store(mode, get_input());
-      break;
-    }
-  case output:
-    { save_output(arg(mode));
-      break;
-    }
-  case jtrue:
-    { num test = arg(mode);
-      num dest = arg(mode);
-      if (test)
-        ip = dest;
-      break;
-    }
-  case jfalse:
-    { num test = arg(mode);
-      num dest = arg(mode);
-      if (!test)
-        ip = dest;
-      break;
-    }
-  case lt:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 < arg2);
-      break;
-    }
-  case eq:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 == arg2);
-      break;
-    }
-  case relbase:
-    { rel_base += arg(mode);
-      break;
-    }
-  case halt:
-    halted = true;
-    return false;
-  default:
-    // Illegal instruction
-    assert(op == halt);
-    break;
-  }
-  return true;
-}
+#include "../intcode/intcode.h"
 
-bool CPU::run() {
-  while (execute())
-    ;
-  return halted;
-}
+using namespace std;
 
 using coords = pair<int, int>;
 
@@ -237,11 +35,62 @@ vector<coords> const dirs{
   { 0, +1 }, { 0, -1 }, { -1, 0 }, { +1, 0 }
 };
 
+// A map that grows as needed; unknown cells are '?'
+struct grid {
+  // Lower left corner and size of the covered area
+  coords origin{ 0, 0 };
+  int width{0};
+  int height{0};
+  // Row by row
+  vector<char> cells;
+
+  char at(coords const &c) const {
+    return inside(c) ? cells[index(c)] : '?';
+  }
+  void set(coords const &c, char ch);
+
+private:
+  bool inside(coords const &c) const {
+    return (c.first >= origin.first && c.first < origin.first + width &&
+            c.second >= origin.second && c.second < origin.second + height);
+  }
+  size_t index(coords const &c) const {
+    return (c.second - origin.second) * width + c.first - origin.first;
+  }
+  // Cover c, with room to spare
+  void grow(coords const &c);
+};
+
+void grid::set(coords const &c, char ch) {
+  if (!inside(c))
+    grow(c);
+  cells[index(c)] = ch;
+}
+
+void grid::grow(coords const &c) {
+  coords ll = c;
+  coords ur = c;
+  if (width > 0) {
+    ll = min(ll, origin);
+    ur = max(ur, origin + coords{ width - 1, height - 1 });
+  }
+  int margin = max({ 8, ur.first - ll.first, ur.second - ll.second }) / 2;
+  grid bigger;
+  bigger.origin = ll + coords{ -margin, -margin };
+  bigger.width = ur.first - ll.first + 1 + 2 * margin;
+  bigger.height = ur.second - ll.second + 1 + 2 * margin;
+  bigger.cells.resize(bigger.width * bigger.height, '?');
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x) {
+      coords old = origin + coords{ x, y };
+      bigger.cells[bigger.index(old)] = cells[index(old)];
+    }
+  *this = move(bigger);
+}
+
 struct droid {
-  // Brains of the droid (read from stdin)
-  CPU cpu;
   // The explored space
-  map<coords, char> world;
+  grid world;
   // Where the oxygen generator is
   optional<coords> generator;
 
@@ -251,8 +100,27 @@ struct droid {
   // Return what's at c, or '?' if unknown
   char at(coords const &c) const;
 
-  // Run the program to explore the world
-  void explore(coords const &pos);
+  // Run the program to explore the world.  Rather than moving one
+  // droid around and backing up, this is a breadth-first search over
+  // droid states: each newly reached cell keeps the CPU that got
+  // there, and trying a direction resumes from a copy of that.
+  // (Copies share memory, page table included, until they write to
+  // it, so they're cheap.)  The cells at each distance are looked
+  // around in parallel.
+  void explore();
+  // Try each unknown direction from pos, starting with the droid cpu
+  // there (which is used up).  Sets what was seen in each direction
+  // ('?' if not tried) and saves the droids that moved, with their
+  // direction.
+  void look_around(coords const &pos, CPU &cpu,
+                   array<char, 4> &seen,
+                   vector<pair<size_t, CPU>> &moved) const;
+  // Put what was seen from pos on the map, and add the droids that
+  // reached new cells to the next frontier.  (A cell that's already
+  // known, e.g., found from another side, keeps what it had.)
+  void settle(coords const &pos, array<char, 4> const &seen,
+              vector<pair<size_t, CPU>> &moved,
+              vector<pair<coords, CPU>> &next_frontier);
 
   // Breadth first search from start looking for an optional target.
   // Returns either the length of the shortest path if the target
@@ -261,43 +129,96 @@ struct droid {
 };
 
 droid::droid() {
-  world.emplace(coords{ 0, 0 }, 'D');
-  explore({ 0, 0 });
+  world.set({ 0, 0 }, 'D');
+  explore();
 }
 
-char droid::at(coords const &c) const {
-  auto p = world.find(c);
-  if (p == world.end())
-    return '?';
-  return p->second;
+char droid::at(coords const &c) const { return world.at(c); }
+
+void droid::explore() {
+  // Cells reached at the current distance, with the droid there
+  vector<pair<coords, CPU>> frontier;
+  // Brains of the droid (read from stdin)
+  frontier.emplace_back(coords{ 0, 0 }, CPU());
+  while (!frontier.empty()) {
+    // What each frontier cell's droid found in each direction, and
+    // the droids that moved
+    vector<array<char, 4>> seen(frontier.size());
+    vector<vector<pair<size_t, CPU>>> moved(frontier.size());
+    auto work =
+      [&](auto &take) {
+        size_t first, last;
+        while (take(first, last))
+          for (size_t j = first; j < last; ++j)
+            look_around(frontier[j].first, frontier[j].second, seen[j],
+                        moved[j]);
+      };
+    parallel_chunks(frontier.size(), 16, work);
+    // Settle in frontier order, so the map is the same as looking
+    // around one cell at a time
+    vector<pair<coords, CPU>> next_frontier;
+    for (size_t j = 0; j < frontier.size(); ++j)
+      settle(frontier[j].first, seen[j], moved[j], next_frontier);
+    frontier = move(next_frontier);
+  }
 }
 
-void droid::explore(coords const &pos) {
+void droid::look_around(coords const &pos, CPU &cpu,
+                        array<char, 4> &seen,
+                        vector<pair<size_t, CPU>> &moved) const {
+  // Directions left to try
+  int unknown = 0;
+  for (auto const &dir : dirs)
+    unknown += at(pos + dir) == '?';
+  // A droid at pos to try moving.  Bumping into a wall leaves it where
+  // it was, so it can try again; one that moves is kept for exploring
+  // from its new cell.  The last direction takes cpu itself rather
+  // than a copy.
+  optional<CPU> trial;
   for (size_t i = 0; i < dirs.size(); ++i) {
-    coords next = pos + dirs[i];
-    if (at(next) != '?')
+    seen[i] = '?';
+    if (at(pos + dirs[i]) != '?')
       // Already know what's there
       continue;
-    auto step = [&](int dir) {
-                  cpu.give_input(dir + 1);
-                  cpu.run();
-                  return cpu.get_output();
-                };
-    int status = step(i);
-    if (status == 0)
-      // Hit a wall and didn't move
-      world.emplace(next, '#');
-    else {
-      if (status == 2) {
+    if (!trial) {
+      if (unknown == 1)
+        trial.emplace(move(cpu));
+      else
+        trial.emplace(cpu);
+    }
+    --unknown;
+    trial->give_input(i + 1);
+    trial->run();
+    int status = trial->get_output();
+    seen[i] = "#.O"[status];
+    if (status != 0) {
+      moved.emplace_back(i, move(*trial));
+      trial.reset();
+    }
+  }
+}
+
+void droid::settle(coords const &pos, array<char, 4> const &seen,
+                   vector<pair<size_t, CPU>> &moved,
+                   vector<pair<coords, CPU>> &next_frontier) {
+  auto droids = moved.begin();
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    if (seen[i] == '?')
+      continue;
+    coords next = pos + dirs[i];
+    bool fresh = at(next) == '?';
+    if (fresh) {
+      if (seen[i] == 'O') {
         assert(!generator);
         generator = next;
       }
-      world.emplace(next, status == 2 ? 'O' : '.');
-      explore(next);
-      // Back up
-      assert(dirs[i ^ 1] + dirs[i] == coords({ 0, 0 }));
-      int status_back = step(i ^ 1);
-      assert(status_back != 0);
+      world.set(next, seen[i]);
+    }
+    if (seen[i] != '#') {
+      assert(droids != moved.end() && droids->first == i);
+      if (fresh)
+        next_frontier.emplace_back(next, move(droids->second));
+      ++droids;
     }
   }
 }
@@ -1,25 +1,37 @@
 // -*- C++ -*-
 // Optimization is definitely needed for this approach, since part 2
-// takes about 1.5 minutes even with that.
+// takes about 1.5 minutes even with that (when done in full).
 //
 // I don't know if there's any way to be more clever.  The
 // abs(output[i] % 10) thing eliminated thoughts about linearity and
 // maybe some sort of sparsity.  Since not many parts of the output
 // are needed, maybe there's some way to chain backwards?
 //
-// g++ -std=c++17 -Wall -g -O -o doit doit.cc
+// Later: there is when the needed digits are in the back half of the
+// signal (as they are for part 2).  See back_phases and
+// phases_direct.
+//
+// g++ -std=c++17 -Wall -g -O3 -pthread -o doit doit.cc
 // ./doit 1 < input  # part 1
 // ./doit 2 < input  # part 2
+// ./doit 2 1000000 < input  # part 2 with a million phases
+// ./doit 2 100 8 < input  # part 2 with 8 threads (default one per core)
+// ./doit 3 < input  # part 2, checking phases_direct against back_phases
 
 #include <iostream>
 #include <string>
 #include <vector>
-#include <numeric>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <thread>
+#include <atomic>
 
 using namespace std;
 
 // Inputs are padded with an initial 0 to get rid of the annoying
-// "skip the very first value exactly once" thing
+// "skip the very first value exactly once" thing.  Signals are stored
+// one digit per byte.
 
 /*
 // Explicit version, for checking against
@@ -40,81 +52,392 @@ vector<int> slow_phase(vector<int> const &input) {
 }
 */
 
+// Reusable barrier for a fixed number of threads
+struct barrier {
+  unsigned const count;
+  atomic<unsigned> waiting{0};
+  atomic<unsigned> generation{0};
+
+  barrier(unsigned count_) : count(count_) {}
+
+  void wait();
+};
+
+void barrier::wait() {
+  unsigned gen = generation.load();
+  if (waiting.fetch_add(1) + 1 == count) {
+    waiting.store(0);
+    generation.fetch_add(1);
+  } else
+    while (generation.load() == gen)
+      this_thread::yield();
+}
+
+// Computes phases for signals of one length, keeping the buffers, the
+// worker threads, and the division of the work into pieces from one
+// phase to the next.  In each phase the workers first make the
+// partial sums (each doing a block of the signal, in two passes) and
+// then take pieces of the rows as they're ready for more.
+struct phaser {
+  // threads = 0 for one per core
+  phaser(int n_, unsigned threads);
+  ~phaser();
+  // Replace x (which has length n) with the next phase
+  void phase(vector<int8_t> &x);
+  // Signal length (including the padding)
+  int n;
+  // Number of worker threads (including the one calling phase)
+  unsigned threads;
+  // sums[j] is the sum of x[k] for k < j
+  vector<int32_t> sums;
+  // The next phase, swapped with x afterwards
+  vector<int8_t> output;
+  // Most rows in a piece
+  static constexpr int max_piece = 1 << 16;
+  // Blocks q in [qlo, qhi) (odd q only, see rows) of rows [lo, hi).
+  // A split piece is part of a single row's blocks; its total goes in
+  // part, and the parts are added up at the end of the phase.
+  struct piece {
+    int lo, hi;
+    int qlo, qhi;
+    bool split;
+  };
+  vector<piece> pieces;
+  vector<int32_t> part;
+  // Running totals for the rows of each worker's current piece
+  vector<vector<int32_t>> totals;
+
+private:
+  // Sum of each worker's block of the signal
+  vector<int32_t> block_sum;
+  // The signal for the current phase, or nullptr to stop the workers
+  vector<int8_t> const *signal{nullptr};
+  atomic<size_t> next_piece{0};
+  barrier sync;
+  // Threads other than the one calling phase
+  vector<thread> pool;
+
+  // Do worker w's share of the current phase
+  void work(unsigned w);
+  // Compute piece p, using total for the running totals
+  void rows(size_t p, int32_t *total);
+};
+
+// Row i costs about n / (2 * i) steps (see rows), so cutting the rows
+// into equal counts would leave one thread with nearly everything.
+// Cut them into pieces of about equal cost instead, several per
+// thread; threads take the pieces in order, so the expensive ones go
+// first and the cheap ones fill in at the end.  The first few rows
+// cost more than a piece each, so they're split by blocks.  The cheap
+// rows are also cut at max_piece, which keeps the totals small enough
+// to stay in cache.
+phaser::phaser(int n_, unsigned threads_) :
+  n(n_), threads(threads_ ? threads_ : max(1u, thread::hardware_concurrency())),
+  sums(n + 1, 0), output(n, 0),
+  totals(threads, vector<int32_t>(min(n, max_piece))),
+  block_sum(threads), sync(threads) {
+  // Number of blocks of row i
+  auto blocks = [&](int i) { return (n / i + 1) / 2; };
+  auto cost = [&](int i) { return blocks(i) + 1.0; };
+  double total = 0;
+  for (int i = 1; i < n; ++i)
+    total += cost(i);
+  double const per_piece = total / (threads == 1 ? 1 : 8 * threads);
+  int lo = 1;
+  double so_far = 0;
+  auto cut =
+    [&](int hi) {
+      if (hi > lo)
+        pieces.push_back({ lo, hi, 1, n + 1, false });
+      lo = hi;
+      so_far = 0;
+    };
+  for (int i = 1; i < n; ++i) {
+    if (cost(i) > per_piece) {
+      cut(i);
+      long b = blocks(i);
+      long k = long(cost(i) / per_piece) + 1;
+      for (long j = 0; j < k; ++j)
+        pieces.push_back({ i, i + 1, int(2 * (b * j / k) + 1),
+                           int(2 * (b * (j + 1) / k) + 1), true });
+      lo = i + 1;
+      continue;
+    }
+    so_far += cost(i);
+    if (so_far >= per_piece || i + 1 - lo >= max_piece)
+      cut(i + 1);
+  }
+  cut(n);
+  part.resize(pieces.size());
+  for (unsigned w = 1; w < threads; ++w)
+    pool.emplace_back(&phaser::work, this, w);
+}
+
+phaser::~phaser() {
+  signal = nullptr;
+  sync.wait();
+  for (auto &t : pool)
+    t.join();
+}
+
+void phaser::phase(vector<int8_t> &x) {
+  assert(int(x.size()) == n);
+  signal = &x;
+  next_piece = 0;
+  sync.wait();
+  work(0);
+  // Add up split rows
+  for (size_t p = 0; p < pieces.size();) {
+    if (!pieces[p].split) {
+      ++p;
+      continue;
+    }
+    int i = pieces[p].lo;
+    int32_t total = 0;
+    for (; p < pieces.size() && pieces[p].split && pieces[p].lo == i; ++p)
+      total += part[p];
+    output[i] = abs(total % 10);
+  }
+  // Padding
+  output[0] = 0;
+  x.swap(output);
+}
+
+void phaser::work(unsigned w) {
+  // Workers other than 0 wait here for each phase (phase() does the
+  // first wait for worker 0)
+  if (w != 0) {
+    sync.wait();
+    if (!signal)
+      return;
+  }
+  for (;;) {
+    auto const &x = *signal;
+    int first = long(n) * w / threads;
+    int last = long(n) * (w + 1) / threads;
+    int32_t sum = 0;
+    for (int j = first; j < last; ++j)
+      sum += x[j];
+    block_sum[w] = sum;
+    sync.wait();
+    sum = 0;
+    for (unsigned v = 0; v < w; ++v)
+      sum += block_sum[v];
+    // (Not partial_sum, which would add up in int8_t)
+    for (int j = first; j < last; ++j) {
+      sum += x[j];
+      sums[j + 1] = sum;
+    }
+    sync.wait();
+    size_t p;
+    while ((p = next_piece++) < pieces.size())
+      rows(p, totals[w].data());
+    sync.wait();
+    if (w == 0)
+      return;
+    sync.wait();
+    if (!signal)
+      return;
+  }
+}
+
 // Turns the repeated +1 +1 +1... or -1 -1 -1... from the base pattern
-// into appropriate partial sums, but otherwise just following the
-// explicit version above
-vector<int> fast_phase(vector<int> const &input) {
+// into differences of partial sums.  Row i gets +(sums[2i] - sums[i]),
+// -(sums[4i] - sums[3i]), +(sums[6i] - sums[5i]), and so on, with
+// indexes clipped to n.  Doing one of those blocks for all rows at a
+// time (rather than all blocks for one row) leaves inner loops with no
+// branches and only strided loads, which the compiler can vectorize.
+// Each added term is a range sum, so the totals stay within 9 * n.
+void phaser::rows(size_t p, int32_t *total) {
+  auto [lo, hi, qlo, qhi, split] = pieces[p];
+  int32_t const *s = sums.data();
+  fill(total, total + (hi - lo), 0);
+  // Block [q * i, (q + 1) * i) of row i, for odd q
+  for (int q = qlo; q < qhi && q <= n / lo; q += 2) {
+    int sign = q % 4 == 1 ? 1 : -1;
+    // Rows where the block fits entirely
+    int whole = min(hi - 1, n / (q + 1));
+    for (int i = lo; i <= whole; ++i)
+      total[i - lo] += sign * (s[(q + 1) * i] - s[q * i]);
+    // Rows where the block is clipped at the end
+    int clipped = min(hi - 1, n / q);
+    for (int i = max(lo, whole + 1); i <= clipped; ++i)
+      total[i - lo] += sign * (s[n] - s[q * i]);
+  }
+  if (split) {
+    part[p] = total[0];
+    return;
+  }
+  for (int i = lo; i < hi; ++i)
+    output[i] = abs(total[i - lo] % 10);
+}
+
+// Output position i depends only on inputs from i on, with the first
+// i of those multiplied by 1.  So when 2 * first >= n, everything
+// from first on depends only on things from first on, all with
+// coefficient 1, and a phase is just a sum from the end.  Returns
+// input[first...] after the given number of phases.  (phases_direct
+// below is faster; this is kept for checking, see part2.)
+template <typename Signal>
+vector<int> back_phases(Signal const &input, int first, int phases) {
   int n = input.size();
-  vector<int> sums = input;
-  partial_sum(sums.begin(), sums.end(), sums.begin());
-  vector<int> output(n, 0);
-  static vector<int> base_pattern{ 0, 1, 0, -1 };
-  for (int i = 1; i < n; ++i) {
-    int const repeats = i;
-    // bpi = base_pattern index
-    int bpi = 0;
-    int j = 0;
-    while (j < n) {
-      int end = min(j + repeats, n);
-      if (base_pattern[bpi] != 0) {
-        // Add (sum over k in [j, end) of input[k]) * base_pattern[bpi]
-        int range_sum = sums[end - 1];
-        if (j > 0)
-          range_sum -= sums[j - 1];
-        output[i] += range_sum * base_pattern[bpi];
-      }
-      j = end;
-      ++bpi;
-      bpi &= 3;
+  assert(2 * first >= n);
+  vector<int> tail;
+  for (int i = first; i < n; ++i)
+    tail.push_back(input[i]);
+  while (phases-- > 0) {
+    int sum = 0;
+    for (auto i = tail.rbegin(); i != tail.rend(); ++i) {
+      sum = (sum + *i) % 10;
+      *i = sum;
     }
-    output[i] = abs(output[i] % 10);
   }
-  return output;
+  return tail;
+}
+
+// C(a, b) mod 10, from C(a, b) mod 2 and mod 5 (Lucas's theorem) and
+// the Chinese remainder theorem
+int binomial_mod10(long a, long b) {
+  // C(a, b) is odd exactly when b's bits are a subset of a's
+  int mod2 = (a & b) == b;
+  // The product of binomials of base 5 digits
+  static int const digit_binomial[5][5] = {
+    { 1, 0, 0, 0, 0 },
+    { 1, 1, 0, 0, 0 },
+    { 1, 2, 1, 0, 0 },
+    { 1, 3, 3, 1, 0 },
+    { 1, 4, 1, 4, 1 }
+  };
+  int mod5 = 1;
+  for (; b > 0 && mod5 != 0; a /= 5, b /= 5)
+    mod5 = mod5 * digit_binomial[a % 5][b % 5] % 5;
+  // 5 is 1 mod 2 and 0 mod 5, 6 is 0 mod 2 and 1 mod 5
+  return (5 * mod2 + 6 * mod5) % 10;
+}
+
+// The same as back_phases (so 2 * offset >= n), but only count
+// values from offset are computed, and without doing the phases.
+// Each phase is a sum from the end, so after k phases the value at
+// offset + t is the sum over j of C(k - 1 + j, j) * input[offset + t +
+// j].  The time doesn't depend on k (beyond its number of digits).
+template <typename Signal>
+vector<int> phases_direct(Signal const &input, long k, int offset,
+                          int count) {
+  int n = input.size();
+  assert(2 * offset >= n && offset + count <= n);
+  vector<int> result;
+  if (k == 0) {
+    for (int t = 0; t < count; ++t)
+      result.push_back(input[offset + t]);
+    return result;
+  }
+  vector<long> sum(count, 0);
+  for (int j = 0; offset + j < n; ++j) {
+    int coeff = binomial_mod10(k - 1 + j, j);
+    if (coeff == 0)
+      continue;
+    for (int t = 0; t < count && offset + t + j < n; ++t)
+      sum[t] += coeff * input[offset + t + j];
+  }
+  for (auto s : sum)
+    result.push_back(s % 10);
+  return result;
 }
 
-vector<int> read(int repeats) {
+// The input's digits (with the padding)
+vector<int8_t> read() {
   string input;
   cin >> input;
   // Pad with an extra 0, as noted above
-  vector<int> result{ 0 };
+  vector<int8_t> result{ 0 };
   for (auto c : input)
     result.push_back(c - '0');
-  int n = result.size() - 1;
-  result.reserve(repeats * n + 1);
-  while (--repeats > 0)
-    result.insert(result.end(), result.begin() + 1, result.begin() + 1 + n);
   return result;
 }
 
-void part1() {
-  auto x = read(1);
-  for (int _ = 0; _ < 100; ++_)
-    x = fast_phase(x);
+// A signal of some number of copies of a base signal (both padded),
+// without storing the copies
+struct repeated {
+  repeated(vector<int8_t> const &base_, int repeats_) :
+    base(base_), period(base.size() - 1), repeats(repeats_) {}
+  int size() const { return repeats * period + 1; }
+  int operator[](int i) const { return i == 0 ? 0 : base[(i - 1) % period + 1]; }
+  // Write the copies out
+  vector<int8_t> expand() const;
+
+  vector<int8_t> const &base;
+  int period;
+  int repeats;
+};
+
+vector<int8_t> repeated::expand() const {
+  vector<int8_t> result;
+  result.reserve(size());
+  result.push_back(0);
+  for (int r = 0; r < repeats; ++r)
+    result.insert(result.end(), base.begin() + 1, base.end());
+  return result;
+}
+
+void part1(long phases, unsigned threads) {
+  auto x = read();
+  phaser p(x.size(), threads);
+  for (long _ = 0; _ < phases; ++_)
+    p.phase(x);
   for (int i = 1; i <= 8; ++i)
-    cout << x[i];
+    cout << int(x[i]);
   cout << '\n';
 }
 
-void part2() {
-  auto x = read(10000);
+// If check, also do back-half phases the slow way and make sure they
+// agree
+void part2(long phases, unsigned threads, bool check) {
+  auto base = read();
+  repeated signal(base, 10000);
   int offset = 0;
   for (int i = 1; i <= 7; ++i)
-    offset = 10 * offset + x[i];
-  for (int _ = 0; _ < 100; ++_)
-    x = fast_phase(x);
-  for (int i = offset + 1; i <= offset + 8; ++i)
-    cout << x[i];
+    offset = 10 * offset + signal[i];
+  // Skip the padding
+  int first = offset + 1;
+  if (2 * first >= signal.size()) {
+    auto digits = phases_direct(signal, phases, first, 8);
+    if (check) {
+      auto slow = back_phases(signal, first, phases);
+      if (!equal(digits.begin(), digits.end(), slow.begin())) {
+        cerr << "phases_direct and back_phases disagree\n";
+        exit(1);
+      }
+    }
+    for (auto d : digits)
+      cout << d;
+    cout << '\n';
+    return;
+  }
+  // The phases don't keep the repetition, so this needs the whole
+  // thing
+  auto x = signal.expand();
+  phaser p(x.size(), threads);
+  for (long _ = 0; _ < phases; ++_)
+    p.phase(x);
+  for (int i = first; i < first + 8; ++i)
+    cout << int(x[i]);
   cout << '\n';
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    cerr << "usage: " << argv[0] << " partnum < input\n";
+  if (argc < 2 || argc > 4) {
+    cerr << "usage: " << argv[0] << " partnum [phases [threads]] < input\n";
+    exit(1);
+  }
+  long phases = argc > 2 ? stol(argv[2]) : 100;
+  if (phases < 0) {
+    cerr << "the number of phases can't be negative\n";
     exit(1);
   }
+  unsigned threads = argc > 3 ? stoul(argv[3]) : 0;
   if (*argv[1] == '1')
-    part1();
+    part1(phases, threads);
   else
-    part2();
+    part2(phases, threads, *argv[1] == '3');
   return 0;
 }
@@ -1,234 +1,29 @@
 // -*- C++ -*-
-// g++ -std=c++17 -Wall -g -o doit doit.cc
+// g++ -std=c++17 -Wall -g -pthread -o doit doit.cc
 // ./doit 1 < input  # part 1
 // ./doit 2 < input  # part 2
 
 #include <iostream>
-#include <sstream>
-#include <string>
 #include <vector>
-#include <list>
+#include <algorithm>
 #include <cassert>
 
-using namespace std;
-
-using num = long;
-
-struct CPU {
-  // Storage
-  vector<num> memory;
-  // Instruction pointer
-  num ip{0};
-  // Relative base
-  num rel_base{0};
-  // Was a halt instruction was executed?
-  bool halted{false};
-
-  // Things read by input instructions
-  list<num> input_values;
-  // Things written by output instructions
-  list<num> output_values;
-
-  // Return memory location
-  num &mem(num addr) {
-    assert(addr >= 0);
-    if (size_t(addr) >= memory.size())
-      memory.resize(max(size_t(addr) + 100, 2 * memory.size()), 0);
-    return memory[addr];
-  }
-
-  // Fetch the next instruction (or the next part of the current
-  // instruction)
-  num fetch() { return mem(ip++); }
-  // Read the next argument in an instruction, handle it appropriately
-  // depending on the argument mode (position or immediate or
-  // relative), update mode in preparation for next argument
-  num arg(num &mode);
-  // Read the address where an operation should store a result, update
-  // memory.  Mode must be position or relative.
-  void store(num mode, num v);
-
-  // Supply a value for input instructions
-  void give_input(num v) { input_values.push_back(v); }
-  // Retrieve the next input value (which must exist)
-  num get_input();
-  // Save an output value
-  void save_output(num v) { output_values.push_back(v); }
-  // Return whatever the last output value was
-  num last_output() const;
-  // Is output available?
-  bool has_output() const { return !output_values.empty(); }
-  // Get output and remove
-  num get_output();
-  // Clear all output
-  void clear_output() { output_values.clear(); }
-  // Send available output values to another CPU (clears all output)
-  void transmit(CPU &other);
-
-  // Execute the next instruction, return true if OK, false if
-  // something stops execution (halt instruction or input with no
-  // available data)
-  bool execute();
-  // Execute instructions until the CPU halts or pauses waiting for
-  // data at an input instruction.  Return true if the CPU halted.
-  bool run();
-
-  // Construct from stdin
-  CPU();
-};
-
-CPU::CPU() {
-  string line;
-  while (getline(cin, line)) {
-    if (line.empty())
-      continue;
-    bool more_lines = line.back() == ',';
-    if (!more_lines)
-      line.push_back(',');
-    stringstream ss(line);
-    num n;
-    char comma;
-    while (ss >> n >> comma)
-      memory.push_back(n);
-    if (!more_lines)
-      break;
-  }
-}
-
-enum opcode { add = 1, mul, input, output,
-              jtrue, jfalse, lt, eq, relbase,
-              halt = 99 };
-
-num CPU::arg(num &mode) {
-  num v = fetch();
-  int m = mode % 10;
-  if (m == 0)
-    v = mem(v);
-  else if (m == 2)
-    v = mem(v + rel_base);
-  mode /= 10;
-  return v;
-}
-
-void CPU::store(num mode, num v) {
-  assert(mode == 0 || mode == 2);
-  num addr = fetch();
-  if (mode == 2)
-    addr += rel_base;
-  mem(addr) = v;
-}
-
-num CPU::get_input() {
-  assert(!input_values.empty());
-  num v = input_values.front();
-  input_values.pop_front();
-  return v;
-}
+#include "../intcode/intcode.h"
 
-num CPU::last_output() const {
-  assert(!output_values.empty());
-  return output_values.back();
-}
-
-num CPU::get_output() {
-  assert(!output_values.empty());
-  num out = output_values.front();
-  output_values.pop_front();
-  return out;
-}
-
-void CPU::transmit(CPU &other) {
-  auto &q = other.input_values;
-  q.splice(q.end(), output_values);
-}
-
-bool CPU::execute() {
-  num op_and_modes = fetch();
-  auto op = opcode(op_and_modes % 100);
-  num mode = op_and_modes / 100;
-  switch (op) {
-  case add:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 + arg2);
-      break;
-    }
-  case mul:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 * arg2);
-      break;
-    }
-  case input:
-    { if (input_values.empty()) {
-        // Pause execution for later resumption at this same
-        // instruction
-        --ip;
-        return false;
-      }
-      store(mode, get_input());
-      break;
-    }
-  case output:
-    { save_output(arg(mode));
-      break;
-    }
-  case jtrue:
-    { num test = arg(mode);
-      num dest = arg(mode);
-      if (test)
-        ip = dest;
-      break;
-    }
-  case jfalse:
-    { num test = arg(mode);
-      num dest = arg(mode);
-      if (!test)
-        ip = dest;
-      break;
-    }
-  case lt:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 < arg2);
-      break;
-    }
-  case eq:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 == arg2);
-      break;
-    }
-  case relbase:
-    { rel_base += arg(mode);
-      break;
-    }
-  case halt:
-    halted = true;
-    return false;
-  default:
-    // Illegal instruction
-    assert(op == halt);
-    break;
-  }
-  return true;
-}
-
-bool CPU::run() {
-  while (execute())
-    ;
-  return halted;
-}
+using namespace std;
 
 struct drone {
   // Brains of done (read from stdin)
   CPU cpu;
+  // The freshly loaded state; each scan starts from here
+  size_t pristine{cpu.snapshot()};
 
   // Scan coordinates (x, y)
   int scan(int x, int y);
 };
 
 int drone::scan(int x, int y) {
+  cpu.restore(pristine);
   cpu.give_input(x);
   cpu.give_input(y);
   cpu.run();
@@ -237,12 +32,15 @@ int drone::scan(int x, int y) {
 
 void part1() {
   drone d;
-  int ans = 0;
+  // The scans are independent, so run them as a batch
+  vector<num> coords;
   for (int y = 0; y < 50; ++y)
-    for (int x = 0; x < 50; ++x)
-      if (drone(d).scan(x, y))
-        ++ans;
-  cout << ans << '\n';
+    for (int x = 0; x < 50; ++x) {
+      coords.push_back(x);
+      coords.push_back(y);
+    }
+  auto beam = d.cpu.map_batch(coords, 2);
+  cout << count(beam.begin(), beam.end(), 1) << '\n';
 }
 
 void part2() {
@@ -250,9 +48,9 @@ void part2() {
   int const sz = 100;
   auto check =
     [&](int y, int &min_x) {
-      while (!drone(d).scan(min_x, y))
+      while (!d.scan(min_x, y))
         ++min_x;
-      return drone(d).scan(min_x + (sz - 1), y - (sz - 1)) != 0;
+      return d.scan(min_x + (sz - 1), y - (sz - 1)) != 0;
     };
   int y = 20;
   int min_x = 0;
@@ -1,235 +1,26 @@
 // -*- C++ -*-
-// g++ -std=c++17 -Wall -g -o doit doit.cc
+// g++ -std=c++17 -Wall -g -pthread -o doit doit.cc
 // ./doit 1 < input  # part 1
 // ./doit 2 < input  # part 2
+// ./doit 2 10000 8 stats.csv < input  # 10k nodes, 8 threads, counters
 
 #include <iostream>
-#include <sstream>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <array>
-#include <list>
 #include <map>
 #include <set>
 #include <optional>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <cassert>
 
-using namespace std;
-
-using num = long;
-
-struct CPU {
-  // Storage
-  vector<num> memory;
-  // Instruction pointer
-  num ip{0};
-  // Relative base
-  num rel_base{0};
-  // Was a halt instruction was executed?
-  bool halted{false};
-  // Do input instructions block?
-  bool blocking{true};
-
-  // Things read by input instructions
-  list<num> input_values;
-  // Things written by output instructions
-  list<num> output_values;
-
-  // Return memory location
-  num &mem(num addr) {
-    assert(addr >= 0);
-    if (size_t(addr) >= memory.size())
-      memory.resize(max(size_t(addr) + 100, 2 * memory.size()), 0);
-    return memory[addr];
-  }
-
-  // Fetch the next instruction (or the next part of the current
-  // instruction)
-  num fetch() { return mem(ip++); }
-  // Read the next argument in an instruction, handle it appropriately
-  // depending on the argument mode (position or immediate or
-  // relative), update mode in preparation for next argument
-  num arg(num &mode);
-  // Read the address where an operation should store a result, update
-  // memory.  Mode must be position or relative.
-  void store(num mode, num v);
-
-  // Supply a value for input instructions
-  void give_input(num v) { input_values.push_back(v); }
-  // Retrieve the next input value (which must exist)
-  num get_input();
-  // Is input available?
-  bool has_input() const { return !input_values.empty(); }
-  // Save an output value
-  void save_output(num v) { output_values.push_back(v); }
-  // Return whatever the last output value was
-  num last_output() const;
-  // Is output available?
-  size_t has_output() const { return output_values.size(); }
-  // Get output and remove
-  num get_output();
-  // Clear all output
-  void clear_output() { output_values.clear(); }
-  // Send available output values to another CPU (clears all output)
-  void transmit(CPU &other);
-
-  // Execute the next instruction, return true if OK, false if
-  // something stops execution (halt instruction or input with no
-  // available data)
-  bool execute();
-  // Execute instructions until the CPU halts or pauses waiting for
-  // data at an input instruction.  Return true if the CPU halted.
-  bool run();
-
-  // Construct from stdin
-  CPU();
-};
-
-CPU::CPU() {
-  string line;
-  while (getline(cin, line)) {
-    if (line.empty())
-      continue;
-    bool more_lines = line.back() == ',';
-    if (!more_lines)
-      line.push_back(',');
-    stringstream ss(line);
-    num n;
-    char comma;
-    while (ss >> n >> comma)
-      memory.push_back(n);
-    if (!more_lines)
-      break;
-  }
-}
-
-enum opcode { add = 1, mul, input, output,
-              jtrue, jfalse, lt, eq, relbase,
-              halt = 99 };
-
-num CPU::arg(num &mode) {
-  num v = fetch();
-  int m = mode % 10;
-  if (m == 0)
-    v = mem(v);
-  else if (m == 2)
-    v = mem(v + rel_base);
-  mode /= 10;
-  return v;
-}
-
-void CPU::store(num mode, num v) {
-  assert(mode == 0 || mode == 2);
-  num addr = fetch();
-  if (mode == 2)
-    addr += rel_base;
-  mem(addr) = v;
-}
-
-num CPU::get_input() {
-  if (!blocking && input_values.empty())
-    return -1;
-  assert(!input_values.empty());
-  num v = input_values.front();
-  input_values.pop_front();
-  return v;
-}
-
-num CPU::last_output() const {
-  assert(!output_values.empty());
-  return output_values.back();
-}
-
-num CPU::get_output() {
-  assert(!output_values.empty());
-  num out = output_values.front();
-  output_values.pop_front();
-  return out;
-}
-
-void CPU::transmit(CPU &other) {
-  auto &q = other.input_values;
-  q.splice(q.end(), output_values);
-}
-
-bool CPU::execute() {
-  num op_and_modes = fetch();
-  auto op = opcode(op_and_modes % 100);
-  num mode = op_and_modes / 100;
-  switch (op) {
-  case add:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 + arg2);
-      break;
-    }
-  case mul:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 * arg2);
-      break;
-    }
-  case input:
-    { if (blocking && input_values.empty()) {
-        // Pause execution for later resumption at this same
-        // instruction
-        --ip;
-        return false;
-      }
-      store(mode, get_input());
-      break;
-    }
-  case output:
-    { save_output(arg(mode));
-      break;
-    }
-  case jtrue:
-    { num test = arg(mode);
-      num dest = arg(mode);
-      if (test)
-        ip = dest;
-      break;
-    }
-  case jfalse:
-    { num test = arg(mode);
-      num dest = arg(mode);
-      if (!test)
-        ip = dest;
-      break;
-    }
-  case lt:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 < arg2);
-      break;
-    }
-  case eq:
-    { num arg1 = arg(mode);
-      num arg2 = arg(mode);
-      store(mode, arg1 == arg2);
-      break;
-    }
-  case relbase:
-    { rel_base += arg(mode);
-      break;
-    }
-  case halt:
-    halted = true;
-    return false;
-  default:
-    // Illegal instruction
-    assert(op == halt);
-    break;
-  }
-  return true;
-}
+#include "../intcode/intcode.h"
 
-bool CPU::run() {
-  while (execute())
-    ;
-  return halted;
-}
+using namespace std;
 
 using coords = pair<int, int>;
 
@@ -252,93 +43,254 @@ vector<coords> const dirs{
 
 using seq = vector<string>;
 
-// The network
+// A packet on its way to addr
+struct packet {
+  num addr;
+  num x;
+  num y;
+};
+
+// Reusable barrier for a fixed number of threads
+struct barrier {
+  unsigned const count;
+  atomic<unsigned> waiting{0};
+  atomic<unsigned> generation{0};
+
+  barrier(unsigned count_) : count(count_) {}
+
+  void wait();
+};
+
+void barrier::wait() {
+  unsigned gen = generation.load();
+  if (waiting.fetch_add(1) + 1 == count) {
+    waiting.store(0);
+    generation.fetch_add(1);
+  } else
+    while (generation.load() == gen)
+      this_thread::yield();
+}
+
+// The network.  The nodes are split into contiguous shards, one per
+// worker thread.  The network runs in rounds: in each one, a worker
+// delivers the packets sent to its nodes during the last round, then
+// runs each node until it's waiting for input.  Packets go into
+// per-(sender, receiver) worker outboxes, double-buffered by round, so
+// routing needs no locks or atomics; the barrier between rounds is
+// the only synchronization.
 struct network {
-  // All the CPUs
+  // All the CPUs, copies of one loaded CPU (so the code pages are
+  // shared and each node has its own copies of the pages it writes)
   vector<CPU> cpus;
+  // Number of worker threads
+  unsigned workers;
+  // outbox[r % 2][from * workers + to] has packets sent in round r
+  // from nodes of worker from to nodes of worker to
+  vector<vector<packet>> outbox[2];
+
+  // Per-node counters
+  struct counters {
+    size_t sent{0};
+    size_t received{0};
+    // Times the node was scheduled
+    size_t runs{0};
+  };
+  vector<counters> stats;
+
+  // What a worker did in a round
+  struct round_info {
+    size_t sent{0};
+    bool idle{true};
+    // Packets sent to the NAT, if any
+    optional<packet> first_nat;
+    optional<packet> last_nat;
+  };
+  vector<round_info> info;
+
   // The packet the NAT received last, if any
   optional<num> nat_x;
   optional<num> nat_y;
   // The last y that the NAT sent when the network was found to be
   // idle
   optional<num> last_nat_y;
-  // CPU instruction pointers, for detecting idling
-  set<vector<int>> idling_ips;
-
-  // Read CPU from stdin
-  network();
+  // Rounds run
+  size_t rounds{0};
+
+  // Read CPU from stdin, make n nodes, use the given number of
+  // threads (0 for one per core)
+  network(size_t n, unsigned threads);
+
+  // Worker responsible for a node
+  unsigned owner(size_t addr) const { return addr * workers / cpus.size(); }
+  // First node for a worker
+  size_t first_node(unsigned w) const {
+    return (w * cpus.size() + workers - 1) / workers;
+  }
 
+  // One round for worker w
+  void step(unsigned w);
   // Run, return either the first y that the NAT sees (first_nat true)
   // or the first y that is sent twice in a row to CPU 0 (first_nat
   // false)
   num run(bool first_nat);
+
+  // Write per-node counters as CSV
+  void dump(ostream &out) const;
 };
 
-network::network() {
+network::network(size_t n, unsigned threads) :
+  workers(threads ? threads : max(1u, thread::hardware_concurrency())),
+  stats(n) {
+  assert(n > 0);
+  workers = min<size_t>(workers, n);
   cpus.emplace_back();
   cpus.back().blocking = false;
-  while (cpus.size() < 50)
+  // Stop after each complete packet (address, x, y)
+  cpus.back().output_pause = 3;
+  while (cpus.size() < n)
     cpus.emplace_back(cpus.back());
   for (size_t addr = 0; addr < cpus.size(); ++addr)
     cpus[addr].give_input(addr);
+  for (auto &boxes : outbox)
+    boxes.resize(workers * workers);
+  info.resize(workers);
+}
+
+void network::step(unsigned w) {
+  auto &mine = info[w];
+  mine = round_info();
+  // Deliver last round's packets
+  auto &incoming = outbox[(rounds + 1) % 2];
+  for (unsigned from = 0; from < workers; ++from) {
+    auto &box = incoming[from * workers + w];
+    for (auto const &p : box) {
+      cpus[p.addr].give_input(p.x);
+      cpus[p.addr].give_input(p.y);
+      ++stats[p.addr].received;
+    }
+    box.clear();
+  }
+  auto &outgoing = outbox[rounds % 2];
+  for (size_t addr = first_node(w); addr < first_node(w + 1); ++addr) {
+    auto &cpu = cpus[addr];
+    ++stats[addr].runs;
+    // Run until the node is waiting for input, collecting packets
+    while (!cpu.run() && cpu.has_output() == 3) {
+      packet p{ cpu.get_output(), cpu.get_output(), cpu.get_output() };
+      ++mine.sent;
+      ++stats[addr].sent;
+      if (p.addr == 255) {
+        if (!mine.first_nat)
+          mine.first_nat = p;
+        mine.last_nat = p;
+      } else {
+        assert(p.addr >= 0 && p.addr < num(cpus.size()));
+        outgoing[w * workers + owner(p.addr)].push_back(p);
+      }
+    }
+    // Two reads in a row with nothing there
+    if (cpu.has_input() || cpu.idle_reads < 2)
+      mine.idle = false;
+  }
 }
 
 num network::run(bool first_nat) {
-  while (true) {
-    vector<int> ips;
-    for (auto &cpu : cpus) {
-      cpu.execute();
-      ips.push_back(cpu.ip);
-      while (cpu.has_output() >= 3) {
-        // Full packet available
-        auto addr = cpu.get_output();
-        auto x = cpu.get_output();
-        auto y = cpu.get_output();
-        if (addr == 255) {
-          if (first_nat)
-            return y;
-          nat_x = x;
-          nat_y = y;
-        } else {
-          assert(addr < num(cpus.size()));
-          cpus[addr].give_input(x);
-          cpus[addr].give_input(y);
+  barrier sync(workers);
+  bool done = false;
+  num answer = 0;
+  // Called by worker 0 between rounds
+  auto decide =
+    [&] {
+      size_t sent = 0;
+      bool idle = true;
+      for (auto const &i : info) {
+        sent += i.sent;
+        idle = idle && i.idle;
+        // Nodes of lower-numbered workers come first, so this keeps
+        // the NAT's view the same as running the nodes in order
+        if (first_nat && i.first_nat && !done) {
+          done = true;
+          answer = i.first_nat->y;
+        }
+        if (i.last_nat) {
+          nat_x = i.last_nat->x;
+          nat_y = i.last_nat->y;
         }
       }
-    }
-    for (auto const &cpu : cpus)
-      if (cpu.has_input() || cpu.has_output())
-        // Stuff is happening
-        idling_ips.clear();
-    if (idling_ips.count(ips)) {
-      // Looks like the network isn't making progress
+      ++rounds;
+      if (done || sent > 0 || !idle)
+        return;
+      // The network isn't making progress
       if (nat_x && nat_y) {
         // The NAT received something
-        if (last_nat_y && *nat_y == *last_nat_y)
-          return *nat_y;
+        if (last_nat_y && *nat_y == *last_nat_y) {
+          done = true;
+          answer = *nat_y;
+          return;
+        }
         last_nat_y = *nat_y;
         cpus[0].give_input(*nat_x);
         cpus[0].give_input(*nat_y);
+        ++stats[0].received;
         nat_x.reset();
         nat_y.reset();
       }
-      idling_ips.clear();
-    } else
-      idling_ips.insert(ips);
-  }
+    };
+  auto work =
+    [&](unsigned w) {
+      while (true) {
+        step(w);
+        sync.wait();
+        if (w == 0)
+          decide();
+        sync.wait();
+        if (done)
+          return;
+      }
+    };
+  vector<thread> pool;
+  for (unsigned w = 1; w < workers; ++w)
+    pool.emplace_back(work, w);
+  work(0);
+  for (auto &t : pool)
+    t.join();
+  return answer;
 }
 
-void part1() { cout << network().run(true) << '\n'; }
-void part2() { cout << network().run(false) << '\n'; }
+void network::dump(ostream &out) const {
+  out << "node,sent,received,runs\n";
+  for (size_t addr = 0; addr < stats.size(); ++addr)
+    out << addr << ',' << stats[addr].sent << ',' << stats[addr].received
+        << ',' << stats[addr].runs << '\n';
+}
+
+// Optional arguments: number of nodes (default 50), number of threads
+// (default one per core), and a file for per-node counters
+void solve(bool first_nat, int argc, char **argv) {
+  size_t n = argc > 2 ? stoul(argv[2]) : 50;
+  unsigned threads = argc > 3 ? stoul(argv[3]) : 0;
+  network net(n, threads);
+  auto start = chrono::steady_clock::now();
+  cout << net.run(first_nat) << '\n';
+  if (argc > 4) {
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    size_t packets = 0;
+    for (auto const &s : net.stats)
+      packets += s.sent;
+    cerr << n << " nodes, " << net.workers << " threads, " << net.rounds
+         << " rounds, " << packets << " packets in " << elapsed.count()
+         << "s\n";
+    ofstream out(argv[4]);
+    net.dump(out);
+  }
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    cerr << "usage: " << argv[0] << " partnum < input\n";
+  if (argc < 2 || argc > 5) {
+    cerr << "usage: " << argv[0]
+         << " partnum [nodes [threads [stats.csv]]] < input\n";
     exit(1);
   }
-  if (*argv[1] == '1')
-    part1();
-  else
-    part2();
+  solve(*argv[1] == '1', argc, argv);
   return 0;
 }
@@ -0,0 +1,61 @@
+// -*- C++ -*-
+// Time the Intcode interpreter on a program that takes one input
+// value, e.g., the day 9 BOOST self-test in sensor boost mode.
+// Build once for each dispatch method to compare them:
+// g++ -std=c++17 -Wall -O2 -DNDEBUG -DINTCODE_THREADED=0 -o bench_switch bench.cc
+// g++ -std=c++17 -Wall -O2 -DNDEBUG -DINTCODE_THREADED=1 -o bench_threaded bench.cc
+// ./bench_switch 2 < ../09/input
+// ./bench_threaded 2 < ../09/input
+// Likewise -DINTCODE_FUSE=0 turns off superinstructions.
+// An optional second argument sets the number of runs (default 10).
+// With a third argument of debug, each run goes through a debugger
+// that has a breakpoint and a watchpoint that are never hit, to
+// measure its overhead:
+// ./bench_threaded 2 10 debug < ../09/input
+
+#include <iostream>
+#include <chrono>
+#include <string>
+
+#include "intcode.h"
+#include "debug.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 4 || (argc == 4 && string(argv[3]) != "debug")) {
+    cerr << "usage: " << argv[0] << " input_value [runs [debug]] < program\n";
+    exit(1);
+  }
+  num input_value = stol(argv[1]);
+  int runs = argc >= 3 ? stoi(argv[2]) : 10;
+  bool debug = argc == 4;
+  debugger dbg;
+  dbg.breakpoints.insert(-1);
+  dbg.watches[-1] = true;
+  CPU const code;
+  double best = 0;
+  double total = 0;
+  for (int i = 0; i < runs; ++i) {
+    CPU cpu(code);
+    cpu.give_input(input_value);
+    auto start = chrono::steady_clock::now();
+    bool halted = debug ? dbg.run(cpu) : cpu.run();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    if (!halted) {
+      cerr << "program is waiting for more input\n";
+      exit(1);
+    }
+    if (i == 0)
+      cout << "output " << cpu.last_output() << '\n';
+    if (i == 0 || elapsed.count() < best)
+      best = elapsed.count();
+    total += elapsed.count();
+  }
+  cout << (INTCODE_THREADED ? "threaded" : "switch") << " dispatch, "
+       << (INTCODE_FUSE ? "fused" : "unfused") << ", "
+       << (debug ? "debugger, " : "")
+       << runs << " runs: best " << best * 1000 << " ms, mean "
+       << total / runs * 1000 << " ms\n";
+  return 0;
+}
@@ -0,0 +1,134 @@
+// -*- C++ -*-
+// Breakpoints, watchpoints, and single-stepping for the Intcode
+// computer.  The debugger is a monitor passed to the CPU's templated
+// run() and execute(), so it costs nothing unless used; days that
+// don't include this header are unchanged.
+//
+//   #include "../intcode/debug.h"
+//   debugger dbg;
+//   dbg.breakpoints.insert(1234);
+//   dbg.watches[567] = false;     // stop before writes to 567
+//   dbg.run(cpu);
+//   if (dbg.stopped != debugger::running)
+//     ... look at cpu, dbg.step(cpu), dbg.run(cpu) to carry on ...
+
+#ifndef INTCODE_DEBUG_H
+#define INTCODE_DEBUG_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <set>
+#include <map>
+
+#include "intcode.h"
+
+// Human-readable form of the instruction at ip
+inline std::string disassemble(CPU const &cpu, insn const &in,
+                               num const *args) {
+  std::ostringstream ss;
+  ss << cpu.ip << ": " << opcode_name(in.op);
+  for (int i = 0; i + 1 < in.len; ++i) {
+    ss << (i == 0 ? " " : ", ");
+    if (in.mode[i] == 0)
+      ss << '[' << args[i] << ']';
+    else if (in.mode[i] == 1)
+      ss << args[i];
+    else
+      ss << "[rb" << (args[i] < 0 ? "" : "+") << args[i] << ']';
+  }
+  return ss.str();
+}
+
+struct debugger {
+  // Every instruction is seen on its own
+  static constexpr bool fusion = false;
+
+  // Stop before executing the instruction at these addresses
+  std::set<num> breakpoints;
+  // Stop before an instruction that writes to an address here, or
+  // that reads it if its value is true
+  std::map<num, bool> watches;
+  // If set, print each instruction here before executing it
+  std::ostream *trace{nullptr};
+
+  // Why execution last stopped (running if it halted or paused for
+  // input as usual)
+  enum reason { running, at_breakpoint, at_watchpoint };
+  reason stopped{running};
+  // The address that triggered the last watchpoint
+  num watched{-1};
+
+  // Run until the CPU halts or pauses, or a breakpoint or watchpoint
+  // is hit.  Returns true if the CPU halted.
+  bool run(CPU &cpu);
+  // Execute one instruction, regardless of breakpoints and
+  // watchpoints.  Returns like CPU::execute().
+  bool step(CPU &cpu);
+
+  bool before(CPU const &cpu, insn const &in, num const *args);
+
+private:
+  // Should the instruction stop execution?
+  reason check(CPU const &cpu, insn const &in, num const *args);
+
+  // Where execution stopped last; run() goes past it rather than
+  // stopping again straight away
+  num resume_ip{-1};
+  // Is before() looking at the first instruction of a run() or
+  // step()?
+  bool first{false};
+  // Is this a step()?
+  bool stepping{false};
+};
+
+inline bool debugger::run(CPU &cpu) {
+  stopped = running;
+  first = true;
+  stepping = false;
+  return cpu.run(*this);
+}
+
+inline bool debugger::step(CPU &cpu) {
+  stopped = running;
+  first = true;
+  stepping = true;
+  return cpu.execute(*this);
+}
+
+inline bool debugger::before(CPU const &cpu, insn const &in,
+                             num const *args) {
+  bool resuming = first && (stepping || cpu.ip == resume_ip);
+  first = false;
+  resume_ip = -1;
+  if (!resuming && (stopped = check(cpu, in, args)) != running) {
+    resume_ip = cpu.ip;
+    return false;
+  }
+  if (trace)
+    *trace << disassemble(cpu, in, args) << '\n';
+  return true;
+}
+
+inline debugger::reason debugger::check(CPU const &cpu, insn const &in,
+                                        num const *args) {
+  if (breakpoints.count(cpu.ip))
+    return at_breakpoint;
+  if (watches.empty())
+    return running;
+  for (int i = 0; i + 1 < in.len; ++i) {
+    if (in.mode[i] == 1)
+      continue;
+    num addr = args[i] + (in.mode[i] == 2 ? cpu.rel_base : 0);
+    auto w = watches.find(addr);
+    // The result operand is last for add, mul, lt, eq, and input
+    bool writes = i == 2 || (i == 0 && in.op == input);
+    if (w != watches.end() && (writes || w->second)) {
+      watched = addr;
+      return at_watchpoint;
+    }
+  }
+  return running;
+}
+
+#endif // INTCODE_DEBUG_H
@@ -0,0 +1,32 @@
+// -*- C++ -*-
+// Convert an Intcode program from the usual comma-separated text to a
+// binary image (see intcode.h), which CPUs load without parsing.
+// g++ -std=c++17 -Wall -g -o image image.cc
+// ./image < ../09/input > ../09/input.bin
+// ../09/doit 2 < ../09/input.bin
+// With -t, convert back to text.
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "intcode.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  bool text = argc == 2 && string(argv[1]) == "-t";
+  if (argc > 2 || (argc == 2 && !text)) {
+    cerr << "usage: " << argv[0] << " [-t] < program > image\n";
+    exit(1);
+  }
+  vector<num> cells = CPU().image();
+  if (!text) {
+    write_image(cout, cells);
+    return 0;
+  }
+  for (size_t i = 0; i < cells.size(); ++i)
+    cout << (i > 0 ? "," : "") << cells[i];
+  cout << '\n';
+  return 0;
+}
@@ -0,0 +1,1344 @@
+// -*- C++ -*-
+// Intcode computer shared by all the days that need one (2019 days 5,
+// 7, 9, 11, 13, 15, 17, 19, 21, 23, 25).  Include it from a day's
+// directory with
+//   #include "../intcode/intcode.h"
+// and compile as usual.
+
+#ifndef INTCODE_H
+#define INTCODE_H
+
+// Instruction dispatch: 1 for computed gotos (a GCC extension, also
+// in clang), 0 for a plain switch.  Compile with -DINTCODE_THREADED=0
+// or =1 to choose.
+#ifndef INTCODE_THREADED
+#ifdef __GNUC__
+#define INTCODE_THREADED 1
+#else
+#define INTCODE_THREADED 0
+#endif
+#endif
+
+// Superinstructions: 1 to fuse common instruction sequences when a
+// program is loaded (the default), 0 to run instructions one by one.
+#ifndef INTCODE_FUSE
+#define INTCODE_FUSE 1
+#endif
+
+// Marks a slow path that should stay out of line, so the fast path
+// that calls it needs no stack frame to speak of
+#ifdef __GNUC__
+#define INTCODE_COLD __attribute__((noinline, cold))
+#else
+#define INTCODE_COLD
+#endif
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parse.h"
+
+using num = long;
+
+enum opcode { add = 1, mul, input, output,
+              jtrue, jfalse, lt, eq, relbase,
+              halt = 99 };
+
+// Superinstructions, which only appear in decoded instructions (see
+// paged_memory::fuse): add or mul that just copies operand 0 or 1,
+// lt or eq followed by a jump on the result, and relbase followed by a
+// jump or by add, mul, lt, or eq
+enum fused_opcode { fused_copy0 = 10, fused_copy1,
+                    fused_lt_jump, fused_eq_jump,
+                    fused_relbase_jump, fused_relbase_arith };
+
+// A decoded instruction: opcode, its length in memory cells, and the
+// modes of the operands (0 = position, 1 = immediate, 2 = relative).
+// For a superinstruction the length covers both parts, and the
+// opcode and modes of the second part are in op2 and mode2.
+struct insn {
+  std::uint8_t op{0};
+  std::uint8_t len{0};
+  std::uint8_t mode[3]{0, 0, 0};
+  std::uint8_t op2{0};
+  std::uint8_t mode2[3]{0, 0, 0};
+};
+
+// Decode an instruction word.  The result has op 0 if the word isn't
+// a valid instruction.
+inline insn decode_word(num op_and_modes) {
+  insn in;
+  int op = op_and_modes % 100;
+  switch (op) {
+  case add: case mul: case lt: case eq: in.len = 4; break;
+  case jtrue: case jfalse: in.len = 3; break;
+  case input: case output: case relbase: in.len = 2; break;
+  case halt: in.len = 1; break;
+  default: return in;
+  }
+  in.op = op;
+  num mode = op_and_modes / 100;
+  for (int i = 0; i + 1 < in.len; ++i, mode /= 10)
+    in.mode[i] = mode % 10;
+  return in;
+}
+
+// Memory, split into fixed-size pages.  Copies of a memory share
+// pages until one of them writes to a page (copy-on-write).  The page
+// table has two levels, a table of directories of pages, and is shared
+// the same way, so copying a CPU costs one reference count; the first
+// write to a page after that copies the table, the page's directory,
+// and the page.  Each page also caches decoded instructions for its
+// cells.  Pages that have never been written are all one shared page
+// of zeros (like lazily mapped zero pages of an anonymous mmap), which
+// also stands in for everything past the end of the page table, so
+// accesses are a bounds check and a few indexed loads.
+struct paged_memory {
+  static constexpr unsigned page_bits = 8;
+  static constexpr size_t page_size = size_t(1) << page_bits;
+  // Pages per directory
+  static constexpr unsigned dir_bits = 5;
+  static constexpr size_t dir_size = size_t(1) << dir_bits;
+
+  struct page {
+    num cell[page_size]{};
+    // Decoded instruction for each cell, valid if op is nonzero
+    insn decoded[page_size];
+    // Cells past the first of some superinstruction (whose decoding
+    // depends on them)
+    std::bitset<page_size> fused;
+
+    // Cell i is changing; forget decoded instructions that depend on
+    // it
+    void forget(size_t i) {
+      decoded[i].op = 0;
+      if (!fused[i])
+        return;
+      // Longest superinstruction is lt/eq + jump
+      for (size_t j = i >= 6 ? i - 6 : 0; j < i; ++j)
+        if (decoded[j].op >= fused_copy0 && j + decoded[j].len > i)
+          decoded[j].op = 0;
+    }
+  };
+
+  struct directory {
+    std::shared_ptr<page> pages[dir_size];
+    directory() { std::fill_n(pages, dir_size, zero_page()); }
+  };
+
+  // The directories (dir_count of them), possibly shared with other
+  // memories, as are the directories and pages themselves
+  std::shared_ptr<std::shared_ptr<directory>[]> dirs;
+  size_t dir_count{0};
+  // The page of zeros (never written, and always shared)
+  static std::shared_ptr<page> const &zero_page() {
+    static std::shared_ptr<page> const zero = std::make_shared<page>();
+    return zero;
+  }
+  // A directory of nothing but the zero page (likewise)
+  static std::shared_ptr<directory> const &zero_directory() {
+    static std::shared_ptr<directory> const zero =
+      std::make_shared<directory>();
+    return zero;
+  }
+  // The first directory, which holds all of most programs, so finding
+  // a page there skips the table
+  directory const *first{zero_directory().get()};
+  // Number of cells in the initial image
+  size_t loaded{0};
+
+  // Position of addr within its page
+  static size_t offset(num addr) { return size_t(addr) & (page_size - 1); }
+
+  // Load an image of n cells at address 0 and decode it.  Cells is
+  // anything indexable, e.g., num const *.
+  template <typename Cells> void load(Cells const &cells, size_t n);
+  // Replace common instruction sequences within a page by
+  // superinstructions
+  static void fuse(page &pg);
+  // The page holding addr (the zero page if it's past the page table)
+  page const *find(num addr) const {
+    size_t p = size_t(addr) >> page_bits;
+    return p < dir_size ? first->pages[p].get() : find_far(p);
+  }
+  // Slow path for find(), given the page number
+  page const *find_far(size_t p) const;
+  // Contents of a cell
+  num read(num addr) const {
+    size_t p = size_t(addr) >> page_bits;
+    return (p < dir_size ? first->pages[p]->cell[offset(addr)]
+                         : find_far(p)->cell[offset(addr)]);
+  }
+  // The page holding addr, if it and everything leading to it are
+  // unshared (so it can be updated in place), otherwise nullptr
+  page *exclusive(num addr) {
+    size_t p = size_t(addr) >> page_bits;
+    size_t d = p >> dir_bits;
+    if (d >= dir_count || dirs.use_count() != 1 || dirs[d].use_count() != 1)
+      return nullptr;
+    auto &pg = dirs[d]->pages[p & (dir_size - 1)];
+    return pg.use_count() == 1 ? pg.get() : nullptr;
+  }
+  // The page holding addr, ready to be changed (made or copied first
+  // if needed)
+  page &writable(num addr) {
+    if (page *pg = exclusive(addr))
+      return *pg;
+    return make_writable(size_t(addr) >> page_bits);
+  }
+  // Slow path for writable(), given the page number
+  page &make_writable(size_t p);
+};
+
+template <typename Cells>
+inline void paged_memory::load(Cells const &cells, size_t n) {
+  size_t used = (n + page_size - 1) >> page_bits;
+  dir_count = (used + dir_size - 1) >> dir_bits;
+  dirs.reset(new std::shared_ptr<directory>[dir_count]);
+  for (size_t d = 0; d < dir_count; ++d)
+    dirs[d] = std::make_shared<directory>();
+  for (size_t p = 0; p < used; ++p) {
+    auto pg = std::make_shared<page>();
+    size_t base = p << page_bits;
+    for (size_t i = 0; i < page_size && base + i < n; ++i) {
+      pg->cell[i] = cells[base + i];
+      pg->decoded[i] = decode_word(pg->cell[i]);
+    }
+    if (INTCODE_FUSE)
+      fuse(*pg);
+    dirs[p >> dir_bits]->pages[p & (dir_size - 1)] = pg;
+  }
+  first = dir_count > 0 ? dirs[0].get() : zero_directory().get();
+  loaded = n;
+}
+
+inline void paged_memory::fuse(page &pg) {
+  auto jump = [](int op) { return op == jtrue || op == jfalse; };
+  auto arith =
+    [](int op) { return op == add || op == mul || op == lt || op == eq; };
+  for (size_t i = 0; i < page_size; ++i) {
+    insn &in = pg.decoded[i];
+    if (in.op == 0 || i + in.len > page_size)
+      continue;
+    num const *args = pg.cell + i + 1;
+    // The following instruction, if it's entirely in this page
+    size_t j = i + in.len;
+    insn next;
+    if (j < page_size && j + pg.decoded[j].len <= page_size)
+      next = pg.decoded[j];
+    int op = 0;
+    if ((in.op == lt || in.op == eq) && jump(next.op) && in.mode[2] != 1 &&
+        next.mode[0] == in.mode[2] && pg.cell[j + 1] == args[2])
+      // Jump on the result of the comparison
+      op = in.op == lt ? fused_lt_jump : fused_eq_jump;
+    else if (in.op == relbase && (jump(next.op) || arith(next.op)))
+      op = next.op == jtrue || next.op == jfalse ? fused_relbase_jump
+                                                 : fused_relbase_arith;
+    if (op != 0) {
+      in.op = op;
+      in.len += next.len;
+      in.op2 = next.op;
+      std::copy_n(next.mode, 3, in.mode2);
+      for (size_t k = i + 1; k < i + in.len; ++k)
+        pg.fused[k] = true;
+      continue;
+    }
+    // Adding 0 or multiplying by 1
+    num identity = in.op == add ? 0 : 1;
+    if ((in.op == add || in.op == mul) && in.mode[2] != 1) {
+      if (in.mode[1] == 1 && args[1] == identity)
+        op = fused_copy0;
+      else if (in.mode[0] == 1 && args[0] == identity)
+        op = fused_copy1;
+    }
+    if (op != 0) {
+      in.op = op;
+      for (size_t k = i + 1; k < i + in.len; ++k)
+        pg.fused[k] = true;
+    }
+  }
+}
+
+INTCODE_COLD inline paged_memory::page const *
+paged_memory::find_far(size_t p) const {
+  size_t d = p >> dir_bits;
+  return (d < dir_count ? dirs[d]->pages[p & (dir_size - 1)].get()
+                        : zero_page().get());
+}
+
+inline paged_memory::page &paged_memory::make_writable(size_t p) {
+  size_t d = p >> dir_bits;
+  if (d >= dir_count || dirs.use_count() > 1) {
+    // Copy the table (growing it if needed)
+    size_t count = d < dir_count ? dir_count : std::max(d + 1, 2 * dir_count);
+    std::shared_ptr<std::shared_ptr<directory>[]> copy(
+      new std::shared_ptr<directory>[count]);
+    for (size_t i = 0; i < count; ++i)
+      copy[i] = i < dir_count ? dirs[i] : zero_directory();
+    dirs = std::move(copy);
+    dir_count = count;
+  }
+  auto &dir = dirs[d];
+  if (dir.use_count() > 1) {
+    dir = std::make_shared<directory>(*dir);
+    if (d == 0)
+      first = dir.get();
+  }
+  auto &pg = dir->pages[p & (dir_size - 1)];
+  if (pg.use_count() > 1)
+    pg = std::make_shared<page>(*pg);
+  return *pg;
+}
+
+// A queue of values for input or output.  It's a ring buffer with a
+// power-of-two capacity that's reused as values come and go, so
+// pushing and popping don't allocate.  (The capacity doubles if it
+// ever fills up.)  One side pushes and the other pops.
+struct fifo {
+  // Storage; the size is always a power of two
+  std::vector<num> buf;
+  // Positions of the first value and one past the last, as running
+  // counts (wrapped to the buffer size when used)
+  size_t head{0};
+  size_t tail{0};
+
+  fifo() : buf(64) {}
+
+  size_t size() const { return tail - head; }
+  bool empty() const { return head == tail; }
+  num front() const { assert(!empty()); return buf[head & mask()]; }
+  num back() const { assert(!empty()); return buf[(tail - 1) & mask()]; }
+  void push(num v) {
+    if (size() == buf.size())
+      grow();
+    buf[tail++ & mask()] = v;
+  }
+  num pop() { num v = front(); ++head; return v; }
+  // The value i places from the front
+  num at(size_t i) const { assert(i < size()); return buf[(head + i) & mask()]; }
+  void clear() { head = tail = 0; }
+  // Move everything from other onto the end of this queue
+  void append(fifo &other);
+
+private:
+  size_t mask() const { return buf.size() - 1; }
+  // Double the capacity
+  void grow();
+};
+
+inline void fifo::grow() {
+  std::vector<num> bigger(2 * buf.size());
+  for (size_t i = head; i != tail; ++i)
+    bigger[i - head] = buf[i & mask()];
+  tail -= head;
+  head = 0;
+  buf.swap(bigger);
+}
+
+inline void fifo::append(fifo &other) {
+  if (empty()) {
+    // Just trade buffers
+    std::swap(buf, other.buf);
+    std::swap(head, other.head);
+    std::swap(tail, other.tail);
+    other.clear();
+    return;
+  }
+  while (buf.size() - size() < other.size())
+    grow();
+  // Copy the (at most two) contiguous pieces of other
+  while (!other.empty()) {
+    size_t from = other.head & other.mask();
+    size_t to = tail & mask();
+    size_t n = std::min({ other.size(), other.buf.size() - from,
+                          buf.size() - to });
+    std::copy_n(other.buf.begin() + from, n, buf.begin() + to);
+    tail += n;
+    other.head += n;
+  }
+  other.clear();
+}
+
+// Binary images: the 8 bytes of image_magic, the number of cells as a
+// little-endian 64-bit integer, and then the cells, likewise.  Make
+// them from the usual text with image.cc.  The CPU constructor takes
+// either form.
+char const image_magic[8] = { 'I', 'n', 't', 'c', 'o', 'd', 'e', '\n' };
+
+// Little-endian 64-bit value at p
+inline std::uint64_t get_le64(unsigned char const *p) {
+  std::uint64_t v = 0;
+  for (int i = 7; i >= 0; --i)
+    v = v << 8 | p[i];
+  return v;
+}
+
+// Store v at p as little-endian
+inline void put_le64(unsigned char *p, std::uint64_t v) {
+  for (int i = 0; i < 8; ++i, v >>= 8)
+    p[i] = v & 0xff;
+}
+
+// The cells of a binary image, indexed in place
+struct image_cells {
+  // Where cell 0 is
+  unsigned char const *data;
+  num operator[](size_t i) const { return num(get_le64(data + 8 * i)); }
+};
+
+// Number of cells in a binary image of size bytes, given its first 16
+// bytes, or false if it isn't one
+inline bool image_header(unsigned char const *header, size_t size,
+                         std::uint64_t &n) {
+  if (size < 16 || std::memcmp(header, image_magic, 8) != 0)
+    return false;
+  n = get_le64(header + 8);
+  return n <= (size - 16) / 8;
+}
+
+// Cells of a binary image of size bytes at data, or false if it isn't
+// one
+inline bool read_image(unsigned char const *data, size_t size,
+                       std::vector<num> &cells) {
+  std::uint64_t n;
+  if (!image_header(data, size, n))
+    return false;
+  image_cells image{data + 16};
+  cells.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    cells[i] = image[i];
+  return true;
+}
+
+// Write cells as a binary image
+inline void write_image(std::ostream &out, std::vector<num> const &cells) {
+  std::vector<unsigned char> data(16 + 8 * cells.size());
+  std::memcpy(data.data(), image_magic, 8);
+  put_le64(data.data() + 8, cells.size());
+  for (size_t i = 0; i < cells.size(); ++i)
+    put_le64(data.data() + 16 + 8 * i, cells[i]);
+  out.write((char const *)data.data(), data.size());
+}
+
+// Work through items [0, count) on several threads (by default one
+// per core, but no more than there are chunks).  Each thread calls
+// work(take) once, and take(first, last) claims the next chunk of up
+// to chunk items as [first, last), or returns false if there are none
+// left.  Threads that finish early just take more chunks.  The
+// calling thread is one of the workers.
+template <typename Work>
+void parallel_chunks(size_t count, size_t chunk, Work work,
+                     unsigned threads = 0) {
+  std::atomic<size_t> next{0};
+  auto take =
+    [&](size_t &first, size_t &last) {
+      first = next.fetch_add(chunk);
+      if (first >= count)
+        return false;
+      last = std::min(first + chunk, count);
+      return true;
+    };
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min<size_t>(threads, (count + chunk - 1) / chunk);
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < threads; ++i)
+    pool.emplace_back([&] { work(take); });
+  work(take);
+  for (auto &t : pool)
+    t.join();
+}
+
+struct CPU;
+struct profiler;
+struct recorder;
+
+// A program translated to C++ by jit.cc and compiled to a shared
+// object.  The object exports one of these as intcode_native.
+struct native_code {
+  // Size and hash of the image that was translated, and sizeof(CPU)
+  // when it was compiled (as a sanity check)
+  size_t size;
+  std::uint64_t hash;
+  size_t cpu_size;
+  // Run starting at cpu.ip.  Returns true if the CPU halted or paused
+  // for input, false if execution left the compiled code.
+  bool (*run)(CPU &cpu);
+  // Is there a compiled block starting at addr?
+  bool (*entry)(num addr);
+  // Is addr part of a compiled instruction?
+  bool (*compiled)(num addr);
+};
+
+// FNV-1a hash of a memory image
+inline std::uint64_t image_hash(num const *cells, size_t n) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= std::uint64_t(cells[i]);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// A number identifying one CPU object over its lifetime, for the
+// profiler and recorder (addresses get reused).  Copying or assigning
+// a CPU gives it a new one, since its history is then different;
+// moving one carries its history along, and so its number.
+struct cpu_id {
+  std::uint64_t value{next()};
+
+  cpu_id() = default;
+  cpu_id(cpu_id const &) : value(next()) {}
+  cpu_id(cpu_id &&other) noexcept : value(other.value) {
+    other.value = next();
+  }
+  cpu_id &operator=(cpu_id const &) { value = next(); return *this; }
+  cpu_id &operator=(cpu_id &&other) noexcept {
+    if (this != &other) {
+      value = other.value;
+      other.value = next();
+    }
+    return *this;
+  }
+
+  static std::uint64_t next() {
+    static std::atomic<std::uint64_t> count{0};
+    return ++count;
+  }
+};
+
+struct CPU {
+  // Storage
+  paged_memory memory;
+  // Instruction pointer
+  num ip{0};
+  // Relative base
+  num rel_base{0};
+  // Was a halt instruction was executed?
+  bool halted{false};
+  // Do input instructions block?  If not, reading with no available
+  // data gives -1, and run() pauses after that instruction.
+  bool blocking{true};
+  // Number of input instructions in a row that found no data (when
+  // non-blocking)
+  size_t idle_reads{0};
+  // If nonzero, run() pauses after an output instruction that brings
+  // the number of waiting output values up to this
+  size_t output_pause{0};
+
+  // Things read by input instructions
+  fifo input_values;
+  // Things written by output instructions
+  fifo output_values;
+
+  // Operands of an instruction that crosses a page boundary
+  num straddle[3];
+
+  // A state saved by snapshot()
+  struct saved_state {
+    num ip;
+    num rel_base;
+    bool halted;
+    fifo input_values;
+    fifo output_values;
+    native_code const *native;
+    // Length of the undo log when saved
+    size_t undo_size;
+  };
+  // Snapshots, oldest first
+  std::vector<saved_state> saved;
+  // Memory writes made since the oldest snapshot (address and old
+  // contents), for undoing them
+  std::vector<std::pair<num, num>> undo;
+  // Native version of the program, if one was loaded and the code
+  // hasn't been modified since
+  native_code const *native{nullptr};
+  // Where run() records a profile, if profiling (shared by copies of
+  // this CPU)
+  std::shared_ptr<profiler> profile;
+  // Where run() logs input and output, if recording
+  std::shared_ptr<recorder> record;
+  // Which CPU this is
+  cpu_id id;
+
+  // Return memory contents
+  num mem(num addr) const {
+    assert(addr >= 0);
+    return memory.read(addr);
+  }
+  // Contents of the first n memory cells, or of as many as were
+  // loaded
+  std::vector<num> image(size_t n) const;
+  std::vector<num> image() const { return image(memory.loaded); }
+  // Set a memory location.  This drops any decoded instruction there
+  // (and the native code if it covers addr), so self-modifying code
+  // works.
+  void poke(num addr, num v) {
+    assert(addr >= 0);
+    auto &pg = memory.writable(addr);
+    auto i = paged_memory::offset(addr);
+    if (!saved.empty())
+      undo.emplace_back(addr, pg.cell[i]);
+    pg.cell[i] = v;
+    pg.forget(i);
+    if (native && native->compiled(addr))
+      native = nullptr;
+  }
+
+  // Return the decoded instruction at ip, decoding it if needed, and
+  // set args to point at its operands
+  insn decode(num const *&args) {
+    auto pg = memory.find(ip);
+    auto i = paged_memory::offset(ip);
+    insn in = pg->decoded[i];
+    if (in.op != 0 && i + in.len <= paged_memory::page_size) {
+      args = pg->cell + i + 1;
+      return in;
+    }
+    return decode_slow(args);
+  }
+  // Decode (and cache, if possible) the instruction at ip
+  insn decode_slow(num const *&args);
+  // The first part of a superinstruction at ip (or in if it's not
+  // one)
+  insn unfused(insn in) const {
+    return in.op >= fused_copy0 ? decode_word(mem(ip)) : in;
+  }
+  // Get the value of an operand, given its mode (position or
+  // immediate or relative) and the raw value from the instruction
+  num load(int mode, num v) const {
+    if (mode == 0)
+      return mem(v);
+    if (mode == 2)
+      return mem(v + rel_base);
+    return v;
+  }
+  // Store a result given its operand mode (position or relative) and
+  // the raw value from the instruction
+  void store(int mode, num addr, num v) {
+    assert(mode == 0 || mode == 2);
+    if (mode == 2)
+      addr += rel_base;
+    poke(addr, v);
+  }
+
+  // Supply a value for input instructions
+  void give_input(num v) { input_values.push(v); }
+  // Is input available?
+  bool has_input() const { return !input_values.empty(); }
+  // Retrieve the next input value (which must exist, unless
+  // non-blocking)
+  num get_input();
+  // Save an output value
+  void save_output(num v) { output_values.push(v); }
+  // Return whatever the last output value was
+  num last_output() const;
+  // Is output available?  (Returns the number of values.)
+  size_t has_output() const { return output_values.size(); }
+  // Get output and remove
+  num get_output();
+  // Clear all output
+  void clear_output() { output_values.clear(); }
+  // Send available output values to another CPU (clears all output)
+  void transmit(CPU &other);
+
+  // Execute the next instruction, return true if OK, false if
+  // something stops execution (halt instruction, input with no
+  // available data, or reaching output_pause)
+  bool execute();
+  // Execute instructions until the CPU halts or pauses (waiting for
+  // data at an input instruction, after a non-blocking input that
+  // found none, or after reaching output_pause).  Return true if the
+  // CPU halted.
+  bool run();
+  // Versions of execute() and run() that tell a monitor about each
+  // instruction before it executes (see no_monitor).  They always
+  // interpret, and also stop if the monitor says to.
+  template <typename Monitor> bool execute(Monitor &monitor) {
+    return interpret<true>(monitor);
+  }
+  template <typename Monitor> bool run(Monitor &monitor) {
+    interpret<false>(monitor);
+    return halted;
+  }
+  // Shared implementation of execute() and run()
+  template <bool once, typename Monitor> bool interpret(Monitor &monitor);
+
+  // Save the current state and return a handle for it.  From then on
+  // memory writes are logged, so that restore() takes time
+  // proportional to the number of writes made since.
+  size_t snapshot();
+  // Go back to a snapshot.  The snapshot remains available; any taken
+  // after it are discarded.
+  void restore(size_t handle);
+
+  // Run many independent queries against the current state.  Query
+  // i reads the arity values inputs[i * arity ...] and its result is
+  // the last value it outputs.  Queries are spread across threads
+  // (default one per core), each with its own copy of this CPU that
+  // is restored after every query.
+  std::vector<num> map_batch(std::vector<num> const &inputs, size_t arity,
+                             unsigned threads = 0) const;
+
+  // Use a shared object produced from jit.cc output for run().
+  // Returns false (and leaves the CPU interpreting) if it can't be
+  // loaded or was made from a different program.
+  bool load_native(char const *path);
+
+  // Read a binary image by mapping the file open on fd, if it is
+  // one, and loading pages straight from the mapping.  Returns false
+  // (having read nothing) if not.
+  bool load_mapped(int fd);
+
+  // Construct from a stream (stdin by default) of comma-separated
+  // values, possibly split across lines that end with a comma, or a
+  // binary image.  A binary image on stdin that's a file is mapped
+  // rather than read.  If the environment variable INTCODE_NATIVE
+  // names a shared object, try to load native code from it.  If
+  // INTCODE_PROFILE is set, profile run() and write the results to
+  // $INTCODE_PROFILE.txt and $INTCODE_PROFILE.folded at exit.  If
+  // INTCODE_RECORD is set, log this CPU's input and output there (see
+  // recorder).
+  CPU(std::istream &in = std::cin);
+};
+
+inline CPU::CPU(std::istream &in) {
+  if (&in != &std::cin || !load_mapped(0)) {
+    std::string data = slurp(in);
+    std::vector<num> image;
+    if (!read_image((unsigned char const *)data.data(), data.size(), image))
+      parse_csv(data.data(), data.data() + data.size(), image);
+    memory.load(image.data(), image.size());
+  }
+  if (char const *path = std::getenv("INTCODE_NATIVE"))
+    if (!load_native(path))
+      std::cerr << "not using native code from " << path << '\n';
+  if (char const *prefix = std::getenv("INTCODE_PROFILE"))
+    profile = std::make_shared<profiler>(prefix);
+  if (char const *path = std::getenv("INTCODE_RECORD"))
+    record = std::make_shared<recorder>(path, *this);
+}
+
+inline std::vector<num> CPU::image(size_t n) const {
+  std::vector<num> cells(n);
+  for (size_t addr = 0; addr < n; ++addr)
+    cells[addr] = mem(addr);
+  return cells;
+}
+
+inline bool CPU::load_mapped(int fd) {
+  struct stat st;
+  // Only a whole regular file (that nothing has read yet) can be
+  // mapped
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 16 ||
+      lseek(fd, 0, SEEK_CUR) != 0)
+    return false;
+  // Check the header before mapping anything (pread leaves the file
+  // offset alone, so on failure nothing has been read)
+  unsigned char header[16];
+  std::uint64_t n;
+  if (pread(fd, header, 16, 0) != 16 || !image_header(header, st.st_size, n))
+    return false;
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return false;
+  memory.load(image_cells{(unsigned char const *)data + 16}, n);
+  munmap(data, st.st_size);
+  return true;
+}
+
+inline bool CPU::load_native(char const *path) {
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    return false;
+  auto nc = (native_code const *)dlsym(handle, "intcode_native");
+  std::vector<num> cells;
+  if (nc)
+    cells = image(nc->size);
+  if (!nc || nc->cpu_size != sizeof(CPU) ||
+      image_hash(cells.data(), cells.size()) != nc->hash) {
+    dlclose(handle);
+    return false;
+  }
+  // The handle stays open; other CPUs copied from this one share it
+  native = nc;
+  return true;
+}
+
+INTCODE_COLD inline insn CPU::decode_slow(num const *&args) {
+  insn in = memory.find(ip)->decoded[paged_memory::offset(ip)];
+  if (in.op == 0) {
+    in = decode_word(mem(ip));
+    if (in.op == 0) {
+      // Illegal instruction
+      assert(in.op != 0);
+      in.len = 1;
+    } else if (auto pg = memory.exclusive(ip))
+      pg->decoded[paged_memory::offset(ip)] = in;
+  }
+  for (int i = 0; i + 1 < in.len; ++i)
+    straddle[i] = mem(ip + 1 + i);
+  args = straddle;
+  return in;
+}
+
+inline num CPU::get_input() {
+  if (!blocking && input_values.empty()) {
+    ++idle_reads;
+    return -1;
+  }
+  assert(!input_values.empty());
+  idle_reads = 0;
+  return input_values.pop();
+}
+
+inline num CPU::last_output() const {
+  assert(!output_values.empty());
+  return output_values.back();
+}
+
+inline num CPU::get_output() {
+  assert(!output_values.empty());
+  return output_values.pop();
+}
+
+inline void CPU::transmit(CPU &other) {
+  other.input_values.append(output_values);
+}
+
+inline size_t CPU::snapshot() {
+  saved.push_back({ ip, rel_base, halted, input_values, output_values,
+                    native, undo.size() });
+  return saved.size() - 1;
+}
+
+inline void CPU::restore(size_t handle) {
+  assert(handle < saved.size());
+  saved.resize(handle + 1);
+  auto const &state = saved.back();
+  while (undo.size() > state.undo_size) {
+    auto [addr, v] = undo.back();
+    undo.pop_back();
+    auto &pg = memory.writable(addr);
+    auto i = paged_memory::offset(addr);
+    pg.cell[i] = v;
+    pg.forget(i);
+  }
+  ip = state.ip;
+  rel_base = state.rel_base;
+  halted = state.halted;
+  input_values = state.input_values;
+  output_values = state.output_values;
+  // Memory is as it was, so any native code that was dropped is good
+  // again
+  native = state.native;
+}
+
+inline std::vector<num> CPU::map_batch(std::vector<num> const &inputs,
+                                       size_t arity,
+                                       unsigned threads) const {
+  assert(arity > 0 && inputs.size() % arity == 0);
+  size_t queries = inputs.size() / arity;
+  std::vector<num> results(queries);
+  auto work =
+    [&](auto take) {
+      CPU cpu(*this);
+      size_t start = cpu.snapshot();
+      size_t first, last;
+      while (take(first, last))
+        for (size_t q = first; q < last; ++q) {
+          cpu.restore(start);
+          for (size_t i = 0; i < arity; ++i)
+            cpu.give_input(inputs[q * arity + i]);
+          cpu.run();
+          results[q] = cpu.last_output();
+        }
+    };
+  parallel_chunks(queries, 64, work, threads);
+  return results;
+}
+
+// A monitor for interpret() that does nothing.  A monitor's before()
+// sees each instruction and its operands before it executes, and
+// returns false to stop execution there (as if paused).  Its fusion
+// says whether it can handle superinstructions; if not, they're split
+// back into their parts before it sees them.
+template <bool fusion_ = true>
+struct no_monitor {
+  static constexpr bool fusion = fusion_;
+  bool before(CPU const &, insn const &, num const *) { return true; }
+};
+
+// Name of an opcode
+inline char const *opcode_name(int op) {
+  static char const *const names[] = {
+    "illegal", "add", "mul", "input", "output",
+    "jtrue", "jfalse", "lt", "eq", "relbase"
+  };
+  return op == halt ? "halt" : op < 10 ? names[op] : "fused";
+}
+
+// An execution profile: how often each address and opcode ran, which
+// way conditional jumps went, the highest address touched, and
+// approximate call stacks.  Intcode has no calls as such, so a
+// relbase that raises the relative base is taken as a function entry
+// (named by its address) and one that lowers the base back past it as
+// the return.  Copies of a CPU share a profiler; it's locked for the
+// duration of each profiled run(), so threads take turns.
+struct profiler {
+  // Results go to prefix.txt and prefix.folded
+  std::string prefix;
+  std::mutex lock;
+  // Total instructions executed
+  size_t total{0};
+  // Executions by address and by opcode
+  std::vector<size_t> count;
+  size_t ops[100]{};
+  // Not-taken and taken counts for jtrue and jfalse, by address
+  std::vector<std::array<size_t, 2>> branches;
+  // Highest address read or written
+  num high_water{0};
+
+  // Call stack of one CPU
+  struct stack {
+    // Function entries, and the relative base before each
+    std::vector<num> frames;
+    std::vector<num> bases;
+    // Instructions executed since frames last changed
+    size_t pending{0};
+  };
+  // (by cpu_id)
+  std::map<std::uint64_t, stack> stacks;
+  // Instructions executed with each call stack
+  std::map<std::vector<num>, size_t> folded;
+
+  // Records one run() of one CPU
+  struct monitor {
+    static constexpr bool fusion = false;
+    profiler &prof;
+    stack &calls;
+
+    bool before(CPU const &cpu, insn const &in, num const *args);
+    // Credit pending instructions to the current stack
+    void flush();
+    ~monitor() { flush(); }
+  };
+
+  profiler(char const *prefix_) : prefix(prefix_) {}
+  ~profiler();
+
+  // Start recording a run of cpu (lock first)
+  monitor start(CPU const &cpu) { return { *this, stacks[cpu.id.value] }; }
+
+  // Summary sorted by count
+  void report(std::ostream &out) const;
+  // Call stacks in the folded format used by flamegraph.pl
+  void write_folded(std::ostream &out) const;
+};
+
+inline bool profiler::monitor::before(CPU const &cpu, insn const &in,
+                                      num const *args) {
+  auto &p = prof;
+  size_t ip = cpu.ip;
+  if (ip >= p.count.size()) {
+    p.count.resize(2 * ip + 1);
+    p.branches.resize(2 * ip + 1);
+  }
+  ++p.total;
+  ++p.count[ip];
+  ++p.ops[in.op];
+  ++calls.pending;
+  p.high_water = std::max(p.high_water, num(ip + in.len - 1));
+  for (int i = 0; i + 1 < in.len; ++i)
+    if (in.mode[i] != 1)
+      p.high_water = std::max(p.high_water,
+                              args[i] + (in.mode[i] == 2 ? cpu.rel_base : 0));
+  if (in.op == jtrue || in.op == jfalse) {
+    bool taken = (cpu.load(in.mode[0], args[0]) != 0) == (in.op == jtrue);
+    ++p.branches[ip][taken];
+  } else if (in.op == relbase) {
+    num base = cpu.rel_base + cpu.load(in.mode[0], args[0]);
+    if (base > cpu.rel_base) {
+      flush();
+      calls.frames.push_back(cpu.ip);
+      calls.bases.push_back(cpu.rel_base);
+    } else if (base < cpu.rel_base && !calls.bases.empty() &&
+               base <= calls.bases.back()) {
+      flush();
+      while (!calls.bases.empty() && base <= calls.bases.back()) {
+        calls.frames.pop_back();
+        calls.bases.pop_back();
+      }
+    }
+  }
+  return true;
+}
+
+inline void profiler::monitor::flush() {
+  if (calls.pending > 0)
+    prof.folded[calls.frames] += calls.pending;
+  calls.pending = 0;
+}
+
+inline profiler::~profiler() {
+  std::ofstream txt(prefix + ".txt");
+  report(txt);
+  std::ofstream stacks_out(prefix + ".folded");
+  write_folded(stacks_out);
+}
+
+inline void profiler::report(std::ostream &out) const {
+  auto percent =
+    [&](size_t n) {
+      std::ostringstream ss;
+      ss.precision(3);
+      ss << 100.0 * n / std::max<size_t>(total, 1) << '%';
+      return ss.str();
+    };
+  out << total << " instructions, highest address " << high_water << '\n';
+  out << "\nby opcode:\n";
+  std::vector<int> by_op;
+  for (int op = 0; op < 100; ++op)
+    if (ops[op] > 0)
+      by_op.push_back(op);
+  std::sort(by_op.begin(), by_op.end(),
+            [&](int o1, int o2) { return ops[o1] > ops[o2]; });
+  for (int op : by_op)
+    out << opcode_name(op) << ' ' << ops[op] << ' ' << percent(ops[op]) << '\n';
+  std::vector<size_t> addrs;
+  for (size_t addr = 0; addr < count.size(); ++addr)
+    if (count[addr] > 0)
+      addrs.push_back(addr);
+  std::stable_sort(addrs.begin(), addrs.end(),
+                   [&](size_t a1, size_t a2) {
+                     return count[a1] > count[a2];
+                   });
+  out << "\nby address:\n";
+  for (size_t addr : addrs)
+    out << addr << ' ' << count[addr] << ' ' << percent(count[addr]) << '\n';
+  out << "\nbranches (address, taken, not taken):\n";
+  for (size_t addr : addrs)
+    if (branches[addr][0] + branches[addr][1] > 0)
+      out << addr << ' ' << branches[addr][1] << ' ' << branches[addr][0]
+          << '\n';
+}
+
+inline void profiler::write_folded(std::ostream &out) const {
+  for (auto const &[frames, n] : folded) {
+    out << "main";
+    for (num f : frames)
+      out << ";fn_" << f;
+    out << ' ' << n << '\n';
+  }
+}
+
+// A monitor that counts instructions
+struct instruction_count {
+  static constexpr bool fusion = false;
+  size_t count{0};
+  bool before(CPU const &, insn const &, num const *) {
+    ++count;
+    return true;
+  }
+};
+
+// A log of everything that goes in and out of a CPU, for replaying
+// without whatever drove it (see replay.cc).  The log is text: a
+// header line
+//   intcode <image size> <image hash> <blocking> <output_pause>
+// then a line for each memory cell that was changed before the first
+// run() (e.g., to insert quarters)
+//   poke <address> <value>
+// and a line for each run()
+//   run <instructions> <halted> <n> <n inputs read> <m> <m outputs>
+// Copies of a CPU share its recorder, but only the first CPU to run
+// is logged (copies, and CPUs that are assigned to, count as different
+// CPUs; see cpu_id).  Changes made between runs other than by input (pokes,
+// restores) aren't logged, so such sessions won't replay.
+struct recorder {
+  std::ofstream log;
+  // The image as loaded
+  std::vector<num> image;
+  // cpu_id of the CPU being logged, once it's run (CPUs on other
+  // threads may be checking)
+  std::uint64_t owner{0};
+  std::mutex claim;
+
+  recorder(char const *path, CPU const &cpu);
+
+  // Run cpu (using the interpreter) and log it, if it's the one being
+  // logged; returns false if not
+  bool run(CPU &cpu);
+};
+
+inline recorder::recorder(char const *path, CPU const &cpu) :
+  log(path), image(cpu.image()) {
+}
+
+inline bool recorder::run(CPU &cpu) {
+  bool first;
+  {
+    std::lock_guard<std::mutex> hold(claim);
+    if (owner && owner != cpu.id.value)
+      return false;
+    first = !owner;
+    owner = cpu.id.value;
+  }
+  if (first) {
+    log << "intcode " << image.size() << ' '
+        << image_hash(image.data(), image.size()) << ' ' << cpu.blocking
+        << ' ' << cpu.output_pause << '\n';
+    for (num addr = 0; size_t(addr) < image.size(); ++addr)
+      if (cpu.mem(addr) != image[addr])
+        log << "poke " << addr << ' ' << cpu.mem(addr) << '\n';
+  }
+  auto inputs = cpu.input_values;
+  size_t outputs = cpu.output_values.size();
+  instruction_count counter;
+  cpu.run(counter);
+  size_t read = inputs.size() - cpu.input_values.size();
+  log << "run " << counter.count << ' ' << cpu.halted << ' ' << read;
+  for (size_t i = 0; i < read; ++i)
+    log << ' ' << inputs.at(i);
+  log << ' ' << cpu.output_values.size() - outputs;
+  for (size_t i = outputs; i < cpu.output_values.size(); ++i)
+    log << ' ' << cpu.output_values.at(i);
+  log << '\n';
+  return true;
+}
+
+// The interpreter proper.  If once, execute a single instruction and
+// return true if OK, false if it halted or paused for input.
+// Otherwise keep going until the CPU halts or pauses.
+//
+// The instruction bodies are written once.  By default they're cases
+// in a switch; with INTCODE_THREADED (GCC or clang) each body ends
+// with its own computed goto to the next instruction's handler, which
+// gives the branch predictor one indirect jump per opcode instead of
+// a single shared one.
+template <bool once, typename Monitor>
+bool CPU::interpret(Monitor &monitor) {
+  insn in;
+  num const *args;
+  // Operand i (0, 1, or 2)
+  auto raw = [&](int i) { return args[i]; };
+  auto arg = [&](int i) { return load(in.mode[i], raw(i)); };
+  auto result = [&](int i, num v) { store(in.mode[i], raw(i), v); };
+  // Scratch value for superinstructions
+  num v;
+#if INTCODE_THREADED
+  // Handlers by opcode, built once (GCC allows label addresses in a
+  // static initializer)
+#define INTCODE_ILLEGAL10                                               \
+  &&op_illegal, &&op_illegal, &&op_illegal, &&op_illegal, &&op_illegal, \
+  &&op_illegal, &&op_illegal, &&op_illegal, &&op_illegal, &&op_illegal
+  static_assert(fused_relbase_arith == 15 && halt == 99,
+                "handler table doesn't match the opcodes");
+  static void *const handler[100] = {
+    &&op_illegal, &&op_add, &&op_mul, &&op_input, &&op_output,
+    &&op_jtrue, &&op_jfalse, &&op_lt, &&op_eq, &&op_relbase,
+    &&op_fused_copy0, &&op_fused_copy1,
+    &&op_fused_lt_jump, &&op_fused_eq_jump,
+    &&op_fused_relbase_jump, &&op_fused_relbase_arith,
+    // 16 to 98
+    INTCODE_ILLEGAL10, INTCODE_ILLEGAL10, INTCODE_ILLEGAL10,
+    INTCODE_ILLEGAL10, INTCODE_ILLEGAL10, INTCODE_ILLEGAL10,
+    INTCODE_ILLEGAL10, INTCODE_ILLEGAL10,
+    &&op_illegal, &&op_illegal, &&op_illegal,
+    &&op_halt
+  };
+#undef INTCODE_ILLEGAL10
+#define INTCODE_OP(name) op_##name:
+#define INTCODE_DISPATCH()                      \
+  do {                                          \
+    if (once)                                   \
+      return true;                              \
+    in = decode(args);                          \
+    if (!Monitor::fusion)                       \
+      in = unfused(in);                         \
+    if (!monitor.before(*this, in, args))       \
+      return false;                             \
+    goto *handler[in.op];                       \
+  } while (0)
+  in = decode(args);
+  if (!Monitor::fusion)
+    in = unfused(in);
+  if (!monitor.before(*this, in, args))
+    return false;
+  goto *handler[in.op];
+  {
+#else
+#define INTCODE_OP(name) case name:
+#define INTCODE_DISPATCH()                      \
+  do {                                          \
+    if (once)                                   \
+      return true;                              \
+    goto dispatch;                              \
+  } while (0)
+ dispatch:
+  in = decode(args);
+  if (!Monitor::fusion)
+    in = unfused(in);
+  if (!monitor.before(*this, in, args))
+    return false;
+  switch (in.op) {
+#endif
+  // Continue with the following instruction
+#define INTCODE_NEXT() do { ip += in.len; INTCODE_DISPATCH(); } while (0)
+  // Continue at dest
+#define INTCODE_JUMP(dest) do { ip = (dest); INTCODE_DISPATCH(); } while (0)
+  INTCODE_OP(add)
+    result(2, arg(0) + arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(mul)
+    result(2, arg(0) * arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(input)
+    if (input_values.empty()) {
+      if (blocking)
+        // Pause execution for later resumption at this same
+        // instruction
+        return false;
+      // Read -1 and pause after the instruction
+      result(0, get_input());
+      ip += in.len;
+      return false;
+    }
+    result(0, get_input());
+    INTCODE_NEXT();
+  INTCODE_OP(output)
+    save_output(arg(0));
+    if (output_values.size() == output_pause) {
+      ip += in.len;
+      return false;
+    }
+    INTCODE_NEXT();
+  INTCODE_OP(jtrue)
+    if (arg(0))
+      INTCODE_JUMP(arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(jfalse)
+    if (!arg(0))
+      INTCODE_JUMP(arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(lt)
+    result(2, arg(0) < arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(eq)
+    result(2, arg(0) == arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(relbase)
+    rel_base += arg(0);
+    INTCODE_NEXT();
+  INTCODE_OP(halt)
+    halted = true;
+    return false;
+  INTCODE_OP(fused_copy0)
+    result(2, arg(0));
+    INTCODE_NEXT();
+  INTCODE_OP(fused_copy1)
+    result(2, arg(1));
+    INTCODE_NEXT();
+  INTCODE_OP(fused_lt_jump)
+    v = arg(0) < arg(1);
+    goto test_jump;
+  INTCODE_OP(fused_eq_jump)
+    v = arg(0) == arg(1);
+  test_jump:
+    {
+      // Where the result goes, and the jump's destination operand
+      // (read first, since the store may copy the page args is in)
+      num dest = raw(2) + (in.mode[2] == 2 ? rel_base : 0);
+      num target = raw(5);
+      result(2, v);
+      if (dest >= ip && dest < ip + in.len) {
+        // The result landed in the instruction itself; decode the
+        // jump afresh
+        ip += 4;
+        INTCODE_DISPATCH();
+      }
+      if ((v != 0) == (in.op2 == jtrue))
+        INTCODE_JUMP(load(in.mode2[1], target));
+      INTCODE_NEXT();
+    }
+  INTCODE_OP(fused_relbase_jump)
+    rel_base += arg(0);
+    if ((load(in.mode2[0], raw(2)) != 0) == (in.op2 == jtrue))
+      INTCODE_JUMP(load(in.mode2[1], raw(3)));
+    INTCODE_NEXT();
+  INTCODE_OP(fused_relbase_arith)
+    rel_base += arg(0);
+    v = load(in.mode2[0], raw(2));
+    switch (in.op2) {
+    case add: v += load(in.mode2[1], raw(3)); break;
+    case mul: v *= load(in.mode2[1], raw(3)); break;
+    case lt: v = v < load(in.mode2[1], raw(3)); break;
+    default: v = v == load(in.mode2[1], raw(3)); break;
+    }
+    store(in.mode2[2], raw(4), v);
+    INTCODE_NEXT();
+#if INTCODE_THREADED
+  op_illegal:
+#else
+  default:
+#endif
+    // Illegal instruction (decode_slow has already complained)
+    INTCODE_NEXT();
+  }
+#undef INTCODE_OP
+#undef INTCODE_DISPATCH
+#undef INTCODE_NEXT
+#undef INTCODE_JUMP
+}
+
+inline bool CPU::execute() {
+  // One instruction at a time, even if fused
+  no_monitor<false> none;
+  return interpret<true>(none);
+}
+
+inline bool CPU::run() {
+  if (record && record->run(*this))
+    return halted;
+  if (profile) {
+    // Profiles are of the interpreter, even if there's native code
+    std::lock_guard<std::mutex> hold(profile->lock);
+    auto monitor = profile->start(*this);
+    return run(monitor);
+  }
+  while (native) {
+    if (native->run(*this))
+      return halted;
+    // Left the compiled code (an indirect jump somewhere unexpected,
+    // or code was modified); interpret until back at a block
+    do
+      if (!execute())
+        return halted;
+    while (native && !native->entry(ip));
+  }
+  no_monitor<> none;
+  interpret<false>(none);
+  return halted;
+}
+
+#endif // INTCODE_H
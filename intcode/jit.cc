@@ -0,0 +1,362 @@
+// -*- C++ -*-
+// Translate an Intcode program to C++ for native execution.
+// g++ -std=c++17 -Wall -g -o jit jit.cc
+// ./jit < ../09/input > boost.cc
+// g++ -std=c++17 -O2 -shared -fPIC -o boost.so boost.cc
+// INTCODE_NATIVE=$PWD/boost.so ../09/doit 2 < ../09/input
+//
+// The program is split into basic blocks by following control flow
+// from address 0.  Jumps with immediate destinations are followed,
+// and immediate values moved into memory that look like code
+// addresses (return addresses pushed before a call) are also tried
+// as entry points.  Any instruction that some other instruction
+// writes into with a position-mode store is self-modifying and is
+// left to the interpreter.  Each remaining block becomes a C++
+// function that returns the next block to run.
+//
+// At run time, a store (or poke) into any compiled instruction drops
+// the native code and the CPU goes back to interpreting, so the
+// result is always correct; it's just fast when the code is static.
+
+#include <iostream>
+#include <vector>
+#include <set>
+#include <map>
+#include <string>
+#include <sstream>
+#include <cassert>
+
+#include "intcode.h"
+
+using namespace std;
+
+// An instruction found by the analysis
+struct instruction {
+  insn in;
+  // Raw operand values
+  num operand[3]{0, 0, 0};
+  // Written by some other instruction?
+  bool dynamic{false};
+};
+
+struct translator {
+  // The program
+  vector<num> image;
+  // Instructions, by address
+  map<num, instruction> code;
+  // Addresses of all words belonging to some instruction, mapped to
+  // the address of the instruction
+  map<num, num> owner;
+  // Addresses where a block starts
+  set<num> leaders;
+
+  // Read from stdin
+  translator();
+
+  // Decode the instruction at addr, if there's a valid one
+  bool decode(num addr, instruction &result) const;
+  // Follow control flow from the entry points
+  void discover();
+  // Mark self-modifying instructions
+  void find_dynamic();
+  // Figure out where blocks start
+  void find_leaders();
+
+  // Expression for an operand's value
+  string value(instruction const &ins, int i) const;
+  // Statement to go to a known address
+  string go(num addr) const;
+  // Write a block starting at addr
+  void block(ostream &out, num addr) const;
+  // Write everything
+  void write(ostream &out) const;
+};
+
+translator::translator() : image(CPU().image()) {
+  discover();
+  find_dynamic();
+  find_leaders();
+}
+
+bool translator::decode(num addr, instruction &result) const {
+  if (addr < 0 || size_t(addr) >= image.size())
+    return false;
+  insn in = decode_word(image[addr]);
+  if (in.op == 0 || size_t(addr + in.len) > image.size())
+    return false;
+  // decode_word takes mode digits as they come; anything it wouldn't
+  // execute sensibly is data as far as translation goes
+  num extra = image[addr] / 100;
+  for (int i = 0; i + 1 < in.len; ++i, extra /= 10) {
+    if (in.mode[i] > 2)
+      return false;
+    result.operand[i] = image[addr + 1 + i];
+  }
+  // No leftover mode digits, and results can't be immediate
+  if (extra != 0)
+    return false;
+  int op = in.op;
+  if ((op == add || op == mul || op == lt || op == eq) && in.mode[2] == 1)
+    return false;
+  if (op == input && in.mode[0] == 1)
+    return false;
+  result.in = in;
+  return true;
+}
+
+void translator::discover() {
+  vector<num> todo{ 0 };
+  set<num> tried;
+  auto imm = [](instruction const &ins, int i) {
+               return ins.in.mode[i] == 1;
+             };
+  while (!todo.empty()) {
+    num addr = todo.back();
+    todo.pop_back();
+    if (tried.count(addr))
+      continue;
+    tried.insert(addr);
+    // Straight-line code starting at addr
+    while (!code.count(addr)) {
+      instruction ins;
+      if (!decode(addr, ins))
+        break;
+      bool overlaps = false;
+      for (int i = 0; i < ins.in.len; ++i)
+        if (owner.count(addr + i))
+          overlaps = true;
+      if (overlaps)
+        // Conflicting decoding; leave this part to the interpreter
+        break;
+      code.emplace(addr, ins);
+      for (int i = 0; i < ins.in.len; ++i)
+        owner.emplace(addr + i, addr);
+      auto op = ins.in.op;
+      if ((op == jtrue || op == jfalse) && imm(ins, 1))
+        todo.push_back(ins.operand[1]);
+      // Moving an immediate into memory (x + 0 or x * 1) is how
+      // return addresses get pushed
+      if (op == add && imm(ins, 0) && imm(ins, 1)) {
+        todo.push_back(ins.operand[0]);
+        todo.push_back(ins.operand[1]);
+      }
+      if (op == mul && imm(ins, 0) && imm(ins, 1)) {
+        if (ins.operand[1] == 1)
+          todo.push_back(ins.operand[0]);
+        if (ins.operand[0] == 1)
+          todo.push_back(ins.operand[1]);
+      }
+      if (op == halt)
+        break;
+      // Unconditional jumps end straight-line code
+      if (op == jtrue && imm(ins, 0) && ins.operand[0] != 0)
+        break;
+      if (op == jfalse && imm(ins, 0) && ins.operand[0] == 0)
+        break;
+      addr += ins.in.len;
+    }
+  }
+}
+
+void translator::find_dynamic() {
+  for (auto const &[addr, ins] : code) {
+    auto op = ins.in.op;
+    int out = -1;
+    if (op == add || op == mul || op == lt || op == eq)
+      out = 2;
+    else if (op == input)
+      out = 0;
+    if (out < 0 || ins.in.mode[out] != 0)
+      continue;
+    auto p = owner.find(ins.operand[out]);
+    if (p != owner.end())
+      code[p->second].dynamic = true;
+  }
+}
+
+void translator::find_leaders() {
+  leaders.insert(0);
+  for (auto const &[addr, ins] : code) {
+    auto op = ins.in.op;
+    if ((op == jtrue || op == jfalse) && ins.in.mode[1] == 1)
+      leaders.insert(ins.operand[1]);
+    if (op == add || op == mul) {
+      // Possible return addresses (see discover)
+      if (ins.in.mode[0] == 1)
+        leaders.insert(ins.operand[0]);
+      if (ins.in.mode[1] == 1)
+        leaders.insert(ins.operand[1]);
+    }
+    // After a jump or self-modifying instruction
+    if (op == jtrue || op == jfalse || ins.dynamic)
+      leaders.insert(addr + ins.in.len);
+  }
+  // Only blocks that start at a compiled instruction
+  for (auto i = leaders.begin(); i != leaders.end(); )
+    if (!code.count(*i) || code.at(*i).dynamic)
+      i = leaders.erase(i);
+    else
+      ++i;
+}
+
+string translator::value(instruction const &ins, int i) const {
+  string v = to_string(ins.operand[i]) + "L";
+  switch (ins.in.mode[i]) {
+  case 0: return "c.mem(" + v + ")";
+  case 2: return "c.mem(" + v + " + c.rel_base)";
+  default: return v;
+  }
+}
+
+string translator::go(num addr) const {
+  if (leaders.count(addr))
+    return "{ c.ip = " + to_string(addr) + "; return { b" +
+      to_string(addr) + ", false }; }";
+  return "{ c.ip = " + to_string(addr) + "; return leave; }";
+}
+
+void translator::block(ostream &out, num addr) const {
+  out << "\n// " << addr << "\nnext b" << addr << "(CPU &c) {\n";
+  while (true) {
+    auto p = code.find(addr);
+    if (p == code.end() || p->second.dynamic) {
+      out << "  " << go(addr) << "\n}\n";
+      return;
+    }
+    auto const &ins = p->second;
+    num after = addr + ins.in.len;
+    auto store = [&](int i, string const &v) {
+                   out << "  c.store(" << int(ins.in.mode[i]) << ", "
+                       << ins.operand[i] << "L, " << v << ");\n";
+                   if (ins.in.mode[i] == 2)
+                     // Might have written into compiled code
+                     out << "  if (!c.native) { c.ip = " << after
+                         << "; return leave; }\n";
+                 };
+    string a0 = ins.in.len > 1 ? value(ins, 0) : "";
+    string a1 = ins.in.len > 2 ? value(ins, 1) : "";
+    switch (ins.in.op) {
+    case add: store(2, a0 + " + " + a1); break;
+    case mul: store(2, a0 + " * " + a1); break;
+    case lt: store(2, "num(" + a0 + " < " + a1 + ")"); break;
+    case eq: store(2, "num(" + a0 + " == " + a1 + ")"); break;
+    case input:
+      out << "  if (!c.has_input()) {\n"
+          << "    if (c.blocking) { c.ip = " << addr << "; return stop; }\n"
+          << "    c.store(" << int(ins.in.mode[0]) << ", " << ins.operand[0]
+          << "L, c.get_input());\n"
+          << "    c.ip = " << after << ";\n"
+          << "    return stop;\n"
+          << "  }\n";
+      store(0, "c.get_input()");
+      break;
+    case output:
+      out << "  c.save_output(" << a0 << ");\n"
+          << "  if (c.has_output() == c.output_pause) { c.ip = " << after
+          << "; return stop; }\n";
+      break;
+    case relbase:
+      out << "  c.rel_base += " << a0 << ";\n";
+      break;
+    case jtrue:
+    case jfalse:
+      { bool sense = ins.in.op == jtrue;
+        string taken = ins.in.mode[1] == 1 ?
+          go(ins.operand[1]) : "return jump(c, " + a1 + ");";
+        if (ins.in.mode[0] == 1) {
+          // Constant test
+          if (sense == (ins.operand[0] != 0)) {
+            out << "  " << taken << "\n}\n";
+            return;
+          }
+        } else
+          out << "  if (" << (sense ? "" : "!") << a0 << ") "
+              << taken << '\n';
+        out << "  " << go(after) << "\n}\n";
+        return;
+      }
+    case halt:
+      out << "  c.ip = " << addr << ";\n"
+          << "  c.halted = true;\n"
+          << "  return stop;\n}\n";
+      return;
+    }
+    if (leaders.count(after)) {
+      out << "  " << go(after) << "\n}\n";
+      return;
+    }
+    addr = after;
+  }
+}
+
+void translator::write(ostream &out) const {
+  size_t n = image.size();
+  out << "// Generated by intcode/jit from a " << n << "-cell program\n"
+      << "// g++ -std=c++17 -O2 -shared -fPIC -I<intcode dir> this.cc\n\n"
+      << "#include \"intcode.h\"\n\n"
+      << "namespace {\n\n"
+      << "// What to run next; if f is null, stopped says whether the\n"
+      << "// CPU halted or paused (true) or left compiled code (false)\n"
+      << "struct next {\n"
+      << "  next (*f)(CPU &);\n"
+      << "  bool stopped;\n"
+      << "};\n\n"
+      << "next const stop{ nullptr, true };\n"
+      << "next const leave{ nullptr, false };\n\n"
+      << "[[maybe_unused]] next jump(CPU &c, num addr);\n";
+  for (num addr : leaders)
+    out << "next b" << addr << "(CPU &c);\n";
+  for (num addr : leaders)
+    block(out, addr);
+  out << "\nnext (*const blocks[" << n << "])(CPU &) = {";
+  for (size_t addr = 0; addr < n; ++addr) {
+    out << (addr % 4 == 0 ? "\n  " : " ");
+    if (leaders.count(addr))
+      out << 'b' << addr << ',';
+    else
+      out << "nullptr,";
+  }
+  out << "\n};\n\n"
+      << "bool const words[" << n << "] = {";
+  for (size_t addr = 0; addr < n; ++addr) {
+    out << (addr % 16 == 0 ? "\n  " : " ");
+    auto p = owner.find(addr);
+    bool compiled = p != owner.end() && !code.at(p->second).dynamic;
+    out << compiled << ',';
+  }
+  out << "\n};\n\n"
+      << "bool entry(num addr) {\n"
+      << "  return addr >= 0 && addr < " << n << " && blocks[addr];\n"
+      << "}\n\n"
+      << "bool compiled(num addr) {\n"
+      << "  return addr >= 0 && addr < " << n << " && words[addr];\n"
+      << "}\n\n"
+      << "next jump(CPU &c, num addr) {\n"
+      << "  c.ip = addr;\n"
+      << "  if (!entry(addr))\n"
+      << "    return leave;\n"
+      << "  return { blocks[addr], false };\n"
+      << "}\n\n"
+      << "bool run(CPU &c) {\n"
+      << "  if (!entry(c.ip))\n"
+      << "    return false;\n"
+      << "  next n{ blocks[c.ip], false };\n"
+      << "  while (n.f)\n"
+      << "    n = n.f(c);\n"
+      << "  return n.stopped;\n"
+      << "}\n\n"
+      << "}\n\n"
+      << "extern \"C\" native_code const intcode_native{\n"
+      << "  " << n << ", " << image_hash(image.data(), n)
+      << "ull, sizeof(CPU), run, entry, compiled\n"
+      << "};\n";
+}
+
+int main(int argc, char **argv) {
+  if (argc != 1) {
+    cerr << "usage: " << argv[0] << " < program > program.cc\n";
+    exit(1);
+  }
+  translator().write(cout);
+  return 0;
+}
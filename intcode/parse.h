@@ -0,0 +1,51 @@
+// -*- C++ -*-
+// Reading comma-separated integers, as used for Intcode programs (and
+// by day 2).  The whole input is read at once and parsed in place with
+// std::from_chars, which stops right at each comma.
+
+#ifndef INTCODE_PARSE_H
+#define INTCODE_PARSE_H
+
+#include <istream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <charconv>
+
+// Everything remaining in a stream
+inline std::string slurp(std::istream &in) {
+  std::string data;
+  char buf[1 << 16];
+  while (auto n = in.rdbuf()->sgetn(buf, sizeof(buf)))
+    data.append(buf, n);
+  return data;
+}
+
+// Parse comma-separated integers in [first, last), appending them to
+// values.  Whitespace (including newlines) is allowed around the
+// numbers, so a program can be split across lines that end with a
+// comma.  Parsing stops after the first number that isn't followed
+// by a comma; the return value is where it stopped.
+template <typename T>
+char const *parse_csv(char const *first, char const *last,
+                      std::vector<T> &values) {
+  // Counting commas is a vectorized scan, and it saves growing values
+  values.reserve(values.size() + std::count(first, last, ',') + 1);
+  auto blank = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+  while (true) {
+    while (first != last && (blank(*first) || *first == '\n'))
+      ++first;
+    T v;
+    auto [next, err] = std::from_chars(first, last, v);
+    if (err != std::errc())
+      return first;
+    values.push_back(v);
+    for (first = next; first != last && blank(*first); ++first)
+      ;
+    if (first == last || *first != ',')
+      return first;
+    ++first;
+  }
+}
+
+#endif // INTCODE_PARSE_H
@@ -0,0 +1,98 @@
+// -*- C++ -*-
+// Replay a log of a CPU's input and output made by running a day with
+// INTCODE_RECORD set, without the day's own logic.  The outputs are
+// checked against the log, and the time spent in the CPU is reported.
+// g++ -std=c++17 -Wall -O2 -o replay replay.cc
+// INTCODE_RECORD=arcade.log ../13/doit 2 < ../13/input
+// ./replay arcade.log < ../13/input
+// With -c, also check the number of instructions executed in each
+// run (this interprets, so it's slower).
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "intcode.h"
+
+using namespace std;
+
+// One logged run()
+struct logged_run {
+  size_t instructions;
+  bool halted;
+  vector<num> inputs;
+  vector<num> outputs;
+};
+
+[[noreturn]] void fail(string const &why) {
+  cerr << why << '\n';
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bool counts = argc == 3 && string(argv[1]) == "-c";
+  if (argc != 2 && !counts) {
+    cerr << "usage: " << argv[0] << " [-c] log < program\n";
+    exit(1);
+  }
+  ifstream log(argv[argc - 1]);
+  CPU cpu;
+  string word;
+  size_t size;
+  uint64_t hash;
+  if (!(log >> word >> size >> hash >> cpu.blocking >> cpu.output_pause) ||
+      word != "intcode")
+    fail("not an Intcode log");
+  vector<num> image = cpu.image();
+  if (image.size() != size || image_hash(image.data(), size) != hash)
+    fail("log is for a different program");
+  vector<logged_run> runs;
+  size_t total = 0;
+  while (log >> word) {
+    if (word == "poke") {
+      num addr, v;
+      log >> addr >> v;
+      cpu.poke(addr, v);
+      continue;
+    }
+    if (word != "run")
+      fail("bad log entry " + word);
+    logged_run r;
+    size_t n;
+    log >> r.instructions >> r.halted >> n;
+    r.inputs.resize(n);
+    for (auto &v : r.inputs)
+      log >> v;
+    log >> n;
+    r.outputs.resize(n);
+    for (auto &v : r.outputs)
+      log >> v;
+    if (!log)
+      fail("truncated log");
+    total += r.instructions;
+    runs.push_back(move(r));
+  }
+  chrono::duration<double> elapsed(0);
+  for (size_t i = 0; i < runs.size(); ++i) {
+    auto const &r = runs[i];
+    for (num v : r.inputs)
+      cpu.give_input(v);
+    instruction_count counter;
+    auto start = chrono::steady_clock::now();
+    bool halted = counts ? cpu.run(counter) : cpu.run();
+    elapsed += chrono::steady_clock::now() - start;
+    vector<num> outputs;
+    while (cpu.has_output())
+      outputs.push_back(cpu.get_output());
+    if (halted != r.halted || outputs != r.outputs ||
+        (counts && counter.count != r.instructions) || cpu.has_input())
+      fail("run " + to_string(i + 1) + " doesn't match the log");
+  }
+  cout << runs.size() << " runs, " << total << " instructions in "
+       << elapsed.count() * 1000 << " ms ("
+       << total / elapsed.count() / 1e6 << "M instructions/s)\n";
+  return 0;
+}